@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vlog.h"
+
+#define LOG_MODULE VLM_test_vlog1
+
+/* Multi-threaded logging throughput benchmark.
+ *
+ * Usage: bench_vlog [MAX_THREADS [MESSAGES_PER_THREAD [POLICY]]] 2>/dev/null
+ *
+ * For 1, 2, 4, ... up to MAX_THREADS threads, logs MESSAGES_PER_THREAD
+ * messages from each thread to bench.log, first synchronously and then
+ * asynchronously with the given backpressure POLICY, and then to the console,
+ * first unbuffered and then buffered.  Reports the rate at which the threads
+ * logged messages, the rate at which they were written out, and the number
+ * of write system calls made. */
+
+static int n_messages = 100000;
+
+/* Returns the number of write system calls made by this process so far, or 0
+ * if that is unknown. */
+static unsigned long long write_syscalls(void) {
+    unsigned long long n = 0;
+    char line[128];
+    FILE* stream;
+
+    stream = fopen("/proc/self/io", "r");
+    if(stream) {
+        while(fgets(line, sizeof line, stream)) {
+            if(sscanf(line, "syscw: %llu", &n) == 1) {
+                break;
+            }
+        }
+        fclose(stream);
+    }
+    return n;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* bench_main(void* arg) {
+    for(int i = 0; i < n_messages; i++) {
+        VLOG_INFO(LOG_MODULE, "benchmark message %d from thread %ld", i, (long)(intptr_t)arg);
+    }
+    return NULL;
+}
+
+static void bench(const char* name, int n_threads, bool async) {
+    pthread_t threads[n_threads];
+    unsigned long long dropped;
+    unsigned long long writes;
+    double start, logged, written;
+
+    dropped = vlog_get_dropped(LOG_MODULE, VLL_INFO);
+    writes = write_syscalls();
+    if(async) {
+        vlog_start_async(256 * 1024);
+    }
+
+    start = now_sec();
+    for(int i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, bench_main, (void*)(intptr_t)i);
+    }
+    for(int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    logged = now_sec();
+    vlog_stop_async();
+    vlog_set_console_buffer(0, 0);
+    written = now_sec();
+
+    dropped = vlog_get_dropped(LOG_MODULE, VLL_INFO) - dropped;
+    writes = write_syscalls() - writes;
+    printf("%-16s %3d threads: %10.0f msgs/s logged, %10.0f msgs/s written, "
+           "%llu dropped, %llu writes\n",
+    name, n_threads, n_threads * (double)n_messages / (logged - start),
+    (n_threads * (double)n_messages - dropped) / (written - start), dropped, writes);
+}
+
+int main(int argc, char* argv[]) {
+    enum vlog_policy policy = VLP_BLOCK;
+    int max_threads = 8;
+
+    if(argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        n_messages = atoi(argv[2]);
+    }
+    if(argc > 3) {
+        policy = vlog_get_policy_val(argv[3]);
+        if(policy == VLP_N_POLICIES) {
+            fprintf(stderr, "%s: unknown policy\n", argv[3]);
+            return 1;
+        }
+    }
+
+    vlog_init();
+    vlog_set_levels(VLM_ANY_MODULE, VLF_CONSOLE, VLL_EMER);
+    vlog_set_levels(VLM_ANY_MODULE, VLF_FILE, VLL_INFO);
+    if(vlog_set_log_file("bench.log", 0)) {
+        return 1;
+    }
+    vlog_set_policy(LOG_MODULE, policy, VLL_WARN);
+
+    for(int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        bench("file sync", n_threads, false);
+        bench("file async", n_threads, true);
+    }
+
+    vlog_set_levels(VLM_ANY_MODULE, VLF_CONSOLE, VLL_INFO);
+    vlog_set_levels(VLM_ANY_MODULE, VLF_FILE, VLL_EMER);
+    for(int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        bench("console", n_threads, false);
+        vlog_set_console_buffer(65536, 100);
+        bench("console buffered", n_threads, false);
+    }
+
+    vlog_exit();
+    return 0;
+}
@@ -1,10 +1,15 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cmocka.h>
@@ -22,6 +27,15 @@ static char file_stash_buffer[1024];
 static char stderr_stash_buffer[1024];
 static char expected_stderr_log_buffer[1024];
 static char expected_file_log_buffer[1024];
+static int file_level_lines[VLL_N_LEVELS];
+static struct tm strftime_tm; /* Time most recently passed to strftime(). */
+static time_t realtime_offset; /* Added to CLOCK_REALTIME, as if it were set. */
+
+/* Lines "Round N ..." written to the log file, the last N, and how many times
+ * N went backward. */
+static int file_round_lines;
+static int file_last_round;
+static int file_rounds_out_of_order;
 
 FILE* __wrap_fopen(const char* filename, const char* mode) {
     return MOCK_FP;
@@ -64,7 +78,18 @@ int __wrap_fflush(FILE* stream) {
     return 0;
 }
 
+int __real_clock_gettime(clockid_t clock, struct timespec* ts);
+int __wrap_clock_gettime(clockid_t clock, struct timespec* ts) {
+    int retval = __real_clock_gettime(clock, ts);
+
+    if(clock == CLOCK_REALTIME) {
+        ts->tv_sec += realtime_offset;
+    }
+    return retval;
+}
+
 size_t __wrap_strftime(char* s, size_t maxsize, const char* format, const struct tm* tm) {
+    strftime_tm = *tm;
     if(strcmp(format, "%Y-%m-%d %H:%M:%S") == 0) {
         return snprintf(s, maxsize, "2024-01-01 12:00:00");
     } else if(strcmp(format, "%H:%M:%S") == 0) {
@@ -74,8 +99,22 @@ size_t __wrap_strftime(char* s, size_t maxsize, const char* format, const struct
 }
 
 int __wrap_fputs(const char* __restrict __s, FILE* __restrict __stream) {
+    char level_name[6];
+    int round;
+
     if(__stream == MOCK_FP) {
         strncpy(file_log_buffer, __s, sizeof(file_log_buffer));
+        if(sscanf(__s, "%*s %*s %5s", level_name) == 1
+        && vlog_get_level_val(level_name) < VLL_N_LEVELS) {
+            file_level_lines[vlog_get_level_val(level_name)]++;
+        }
+        if(sscanf(__s, "%*s %*s %*s %*s %*s Round %d", &round) == 1) {
+            file_round_lines++;
+            if(round < file_last_round) {
+                file_rounds_out_of_order++;
+            }
+            file_last_round = round;
+        }
     } else if(__stream == stderr) {
         strncpy(stderr_log_buffer, __s, sizeof(stderr_log_buffer));
     }
@@ -251,6 +290,325 @@ static void test_vlog_rate_limit(void** state) {
     }
 }
 
+static void check_rate_limit_subsecond(void) {
+    struct vlog_rate_limit rl = VLOG_RATE_LIMIT_INIT(6000, 1);
+
+    vlog_set_levels(VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_INFO);
+
+    test_vlog_log(VLL_INFO, LOG_MODULE1, "test.c", 10, "An info message 0");
+    VLOG_RL(LOG_MODULE1, &rl, VLL_INFO, "test.c", 10, "An info message 0");
+    assert_string_equal(file_stash_buffer, expected_file_log_buffer);
+    memset(file_stash_buffer, 0, sizeof(file_stash_buffer));
+
+    VLOG_RL(LOG_MODULE1, &rl, VLL_INFO, "test.c", 10, "An info message 1");
+    assert_string_equal(file_stash_buffer, "");
+
+    /* 6000 messages per minute is one every 10 ms. */
+    usleep(20000);
+    test_vlog_log(VLL_INFO, LOG_MODULE1, "test.c", 10,
+    "Dropped 1 messages in last 0 seconds due to excessive rate");
+    VLOG_RL(LOG_MODULE1, &rl, VLL_INFO, "test.c", 10, "An info message 2");
+    assert_string_equal(file_stash_buffer, expected_file_log_buffer);
+}
+
+static void test_vlog_rate_limit_subsecond(void** state) {
+    will_return_maybe(__wrap_ftell, 100);
+
+    check_rate_limit_subsecond();
+}
+
+static void test_vlog_tsc(void** state) {
+    will_return_maybe(__wrap_ftell, 100);
+
+    if(vlog_use_tsc(true)) {
+        skip();
+    }
+
+    test_vlog_log(VLL_INFO, LOG_MODULE1, "test.c", 10, "An info message");
+    VLOG(LOG_MODULE1, VLL_INFO, "test.c", 10, "An info message");
+    assert_string_equal(file_stash_buffer, expected_file_log_buffer);
+    assert_string_equal(stderr_stash_buffer, expected_stderr_log_buffer);
+
+    /* The message's TSC timestamp must convert to the current time. */
+    assert_true(labs((long)(mktime(&strftime_tm) - time(NULL))) <= 1);
+
+    check_rate_limit_subsecond();
+
+    vlog_use_tsc(false);
+}
+
+static void test_vlog_set_levels_from_string(void** state) {
+    const char* config = "vlog:file:dbg, test_vlog*:console:warn # comment\n"
+                         "test_vlog2:any:err\n"
+                         "test_vlog1:policy:drop_below:err, test_vlog2:policy:drop_oldest\n";
+
+    will_return_maybe(__wrap_ftell, 100);
+
+    vlog_set_levels(VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_WARN);
+    vlog_set_policy(VLM_vlog, VLP_DROP_NEWEST, VLL_EMER);
+
+    assert_int_equal(vlog_set_levels_from_string(config), 0);
+    assert_int_equal(vlog_get_level(VLM_vlog, VLF_FILE), VLL_DBG);
+    assert_int_equal(vlog_get_level(VLM_vlog, VLF_CONSOLE), VLL_INFO);
+    assert_int_equal(vlog_get_level(LOG_MODULE1, VLF_CONSOLE), VLL_WARN);
+    assert_int_equal(vlog_get_level(LOG_MODULE1, VLF_FILE), VLL_INFO);
+    assert_int_equal(vlog_get_level(LOG_MODULE2, VLF_CONSOLE), VLL_ERR);
+    assert_int_equal(vlog_get_level(LOG_MODULE2, VLF_FILE), VLL_ERR);
+    assert_true(vlog_is_enabled(VLM_vlog, VLL_DBG));
+    assert_false(vlog_is_enabled(LOG_MODULE2, VLL_WARN));
+    assert_int_equal(vlog_get_policy(VLM_vlog), VLP_BLOCK);
+    assert_int_equal(vlog_get_policy(LOG_MODULE1), VLP_DROP_BELOW);
+    assert_int_equal(vlog_get_policy(LOG_MODULE2), VLP_DROP_OLDEST);
+
+    /* Invalid configurations leave the current one in place. */
+    assert_int_equal(vlog_set_levels_from_string("vlog:file:verbose"), EINVAL);
+    assert_int_equal(vlog_set_levels_from_string("nosuchmodule:file:dbg"), EINVAL);
+    assert_int_equal(vlog_set_levels_from_string("vlog:file"), EINVAL);
+    assert_int_equal(vlog_set_levels_from_string("vlog:policy:drop_everything"), EINVAL);
+    assert_int_equal(vlog_get_level(VLM_vlog, VLF_FILE), VLL_DBG);
+    assert_int_equal(vlog_get_level(LOG_MODULE2, VLF_CONSOLE), VLL_ERR);
+    assert_int_equal(vlog_get_policy(LOG_MODULE1), VLP_DROP_BELOW);
+
+    vlog_set_policy(VLM_ANY_MODULE, VLP_BLOCK, VLL_EMER);
+}
+
+static void write_config_file(const char* file_name, const char* config) {
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, config, strlen(config)), strlen(config));
+    close(fd);
+}
+
+static void test_vlog_set_config_file(void** state) {
+    char dir_name[] = "/tmp/test_vlog.XXXXXX";
+    char file_name[sizeof dir_name + 16];
+    int i;
+
+    will_return_maybe(__wrap_ftell, 100);
+
+    assert_non_null(mkdtemp(dir_name));
+    snprintf(file_name, sizeof file_name, "%s/vlog.conf", dir_name);
+
+    write_config_file(file_name, "test_vlog1:any:dbg");
+    assert_int_equal(vlog_set_config_file(file_name), 0);
+    assert_int_equal(vlog_get_level(LOG_MODULE1, VLF_FILE), VLL_DBG);
+
+    /* A change is picked up in the background. */
+    write_config_file(file_name, "test_vlog1:any:err");
+    for(i = 0; i < 200 && vlog_get_level(LOG_MODULE1, VLF_FILE) != VLL_ERR; i++) {
+        usleep(10000);
+    }
+    assert_int_equal(vlog_get_level(LOG_MODULE1, VLF_FILE), VLL_ERR);
+
+    /* A bad change is rejected. */
+    write_config_file(file_name, "test_vlog1:any:bogus");
+    usleep(100000);
+    assert_int_equal(vlog_get_level(LOG_MODULE1, VLF_FILE), VLL_ERR);
+
+    vlog_set_config_file(NULL);
+    unlink(file_name);
+    rmdir(dir_name);
+}
+
+static void test_vlog_console_buffer(void** state) {
+    char expected[sizeof(expected_stderr_log_buffer) * 2];
+    int i;
+
+    will_return_maybe(__wrap_ftell, 100);
+
+    vlog_set_levels(VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_INFO);
+    assert_int_equal(vlog_set_console_buffer(4096, 10000), 0);
+
+    /* Less severe messages stay in the buffer... */
+    test_vlog_log(VLL_INFO, LOG_MODULE1, "test.c", 10, "An info message");
+    VLOG(LOG_MODULE1, VLL_INFO, "test.c", 10, "An info message");
+    assert_string_equal(file_stash_buffer, expected_file_log_buffer);
+    assert_string_equal(stderr_stash_buffer, "");
+    strcpy(expected, expected_stderr_log_buffer);
+
+    /* ...until an error flushes them together with it. */
+    test_vlog_log(VLL_ERR, LOG_MODULE1, "test.c", 20, "An error message");
+    VLOG(LOG_MODULE1, VLL_ERR, "test.c", 20, "An error message");
+    strcat(expected, expected_stderr_log_buffer);
+    assert_string_equal(stderr_stash_buffer, expected);
+
+    /* Or until the deadline passes. */
+    assert_int_equal(vlog_set_console_buffer(4096, 50), 0);
+    memset(stderr_stash_buffer, 0, sizeof(stderr_stash_buffer));
+    test_vlog_log(VLL_INFO, LOG_MODULE1, "test.c", 30, "An info message");
+    VLOG(LOG_MODULE1, VLL_INFO, "test.c", 30, "An info message");
+    for(i = 0; i < 200 && !stderr_stash_buffer[0]; i++) {
+        usleep(10000);
+    }
+    assert_string_equal(stderr_stash_buffer, expected_stderr_log_buffer);
+}
+
+static void test_vlog_scope(void** state) {
+    int n_dbg = file_level_lines[VLL_DBG];
+    int n_info = file_level_lines[VLL_INFO];
+
+    will_return_maybe(__wrap_ftell, 100);
+
+    vlog_set_levels(VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_WARN);
+    assert_false(VLOG_IS_DBG_ENABLED(LOG_MODULE1));
+
+    /* Disabled messages in a scope are discarded when it ends... */
+    vlog_scope_begin();
+    assert_true(VLOG_IS_DBG_ENABLED(LOG_MODULE1));
+    assert_true(VLOG_IS_INFO_ENABLED(LOG_MODULE1));
+    VLOG(LOG_MODULE1, VLL_DBG, "test.c", 10, "A debug message");
+    VLOG(LOG_MODULE1, VLL_INFO, "test.c", 20, "An info message");
+    vlog_scope_end(false);
+    assert_int_equal(file_level_lines[VLL_DBG], n_dbg);
+    assert_int_equal(file_level_lines[VLL_INFO], n_info);
+    assert_string_equal(file_stash_buffer, "");
+
+    /* ...unless the scope is kept, and then they are formatted as usual... */
+    vlog_scope_begin();
+    vlog_scope_begin();
+    test_vlog_log(VLL_DBG, LOG_MODULE1, "test.c", 10, "A debug message %d %-4s|%.*s %5.2f %lld %zu %c %%",
+    42, "ab", 3, "abcdef", 3.14159, -7LL, (size_t)9, 'x');
+    VLOG(LOG_MODULE1, VLL_DBG, "test.c", 10, "A debug message %d %-4s|%.*s %5.2f %lld %zu %c %%",
+    42, "ab", 3, "abcdef", 3.14159, -7LL, (size_t)9, 'x');
+    vlog_scope_end(true);
+    assert_string_equal(file_stash_buffer, "");
+    vlog_scope_end(false);
+    assert_string_equal(file_stash_buffer, expected_file_log_buffer);
+    assert_int_equal(file_level_lines[VLL_DBG], ++n_dbg);
+
+    /* ...or an error in the scope writes them out ahead of itself. */
+    vlog_scope_begin();
+    VLOG(LOG_MODULE1, VLL_DBG, "test.c", 10, "A debug message");
+    VLOG(LOG_MODULE1, VLL_INFO, "test.c", 20, "An info message");
+    test_vlog_log(VLL_ERR, LOG_MODULE1, "test.c", 30, "An error message");
+    VLOG(LOG_MODULE1, VLL_ERR, "test.c", 30, "An error message");
+    assert_string_equal(file_stash_buffer, expected_file_log_buffer);
+    assert_int_equal(file_level_lines[VLL_DBG], ++n_dbg);
+    assert_int_equal(file_level_lines[VLL_INFO], ++n_info);
+    vlog_scope_end(false);
+}
+
+#define STRESS_THREADS 4
+#define STRESS_MESSAGES 2000
+
+static void* stress_main(void* arg) {
+    for(int i = 0; i < STRESS_MESSAGES; i++) {
+        VLOG(LOG_MODULE1, VLL_INFO, "test.c", 10, "An info message %d", i);
+        if(i % 10 == 0) {
+            VLOG(LOG_MODULE1, VLL_ERR, "test.c", 20, "An error message %d", i);
+        }
+        VLOG(LOG_MODULE2, VLL_INFO, "test.c", 30, "An info message %d", i);
+    }
+    return NULL;
+}
+
+static void test_vlog_async_drop_below(void** state) {
+    pthread_t threads[STRESS_THREADS];
+    unsigned long long info_dropped;
+    unsigned long long err_dropped;
+    unsigned long long oldest_dropped;
+
+    vlog_set_log_file("test.log", 0);
+    vlog_set_levels(VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_INFO);
+    vlog_set_policy(LOG_MODULE1, VLP_DROP_BELOW, VLL_ERR);
+    vlog_set_policy(LOG_MODULE2, VLP_DROP_OLDEST, VLL_EMER);
+    info_dropped = vlog_get_dropped(LOG_MODULE1, VLL_INFO);
+    err_dropped = vlog_get_dropped(LOG_MODULE1, VLL_ERR);
+    oldest_dropped = vlog_get_dropped(LOG_MODULE2, VLL_INFO);
+    memset(file_level_lines, 0, sizeof(file_level_lines));
+
+    assert_int_equal(vlog_start_async(4096), 0);
+    for(int i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress_main, NULL);
+    }
+    for(int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    vlog_stop_async();
+
+    info_dropped = vlog_get_dropped(LOG_MODULE1, VLL_INFO) - info_dropped;
+    err_dropped = vlog_get_dropped(LOG_MODULE1, VLL_ERR) - err_dropped;
+    oldest_dropped = vlog_get_dropped(LOG_MODULE2, VLL_INFO) - oldest_dropped;
+    assert_int_equal(err_dropped, 0);
+    assert_int_equal(file_level_lines[VLL_ERR], STRESS_THREADS * STRESS_MESSAGES / 10);
+    assert_int_equal(file_level_lines[VLL_INFO] + info_dropped + oldest_dropped,
+    2 * STRESS_THREADS * STRESS_MESSAGES);
+
+    vlog_set_policy(VLM_ANY_MODULE, VLP_BLOCK, VLL_EMER);
+}
+
+#define MERGE_THREADS 4
+#define MERGE_ROUNDS 200
+
+static pthread_barrier_t merge_barrier;
+
+static void* merge_main(void* arg) {
+    for(int i = 0; i < MERGE_ROUNDS; i++) {
+        VLOG(LOG_MODULE1, VLL_INFO, "test.c", 40, "Round %d of thread %d", i, (int)(intptr_t)arg);
+        pthread_barrier_wait(&merge_barrier);
+    }
+    return NULL;
+}
+
+static void test_vlog_async_merge(void** state) {
+    unsigned long long dropped = vlog_get_dropped(LOG_MODULE1, VLL_INFO);
+    pthread_t threads[MERGE_THREADS];
+
+    vlog_set_log_file("test.log", 0);
+    vlog_set_levels(VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_INFO);
+    file_round_lines = 0;
+    file_last_round = 0;
+    file_rounds_out_of_order = 0;
+
+    /* Every thread timestamps its message for a round before any thread
+     * starts the next round, so the rounds must come out in order even though
+     * each thread queues its messages separately. */
+    pthread_barrier_init(&merge_barrier, NULL, MERGE_THREADS);
+    assert_int_equal(vlog_start_async(64 * 1024), 0);
+    for(int i = 0; i < MERGE_THREADS; i++) {
+        pthread_create(&threads[i], NULL, merge_main, (void*)(intptr_t)i);
+    }
+    for(int i = 0; i < MERGE_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* The threads have exited, but their messages must still come out. */
+    vlog_stop_async();
+    pthread_barrier_destroy(&merge_barrier);
+
+    assert_int_equal(file_round_lines, MERGE_THREADS * MERGE_ROUNDS);
+    assert_int_equal(file_rounds_out_of_order, 0);
+    assert_int_equal(vlog_get_dropped(LOG_MODULE1, VLL_INFO), dropped);
+}
+
+#define CLOCK_STEP_MESSAGES 200
+
+static void test_vlog_async_clock_step(void** state) {
+    vlog_set_log_file("test.log", 0);
+    vlog_set_levels(VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_INFO);
+    memset(file_level_lines, 0, sizeof(file_level_lines));
+
+    /* Setting the system clock back an hour in the middle of asynchronous
+     * logging must not hold back the messages logged before that until the
+     * clock catches up, or block the thread once its queue fills. */
+    assert_int_equal(vlog_start_async(8192), 0);
+    for(int i = 0; i < CLOCK_STEP_MESSAGES; i++) {
+        VLOG(LOG_MODULE1, VLL_INFO, "test.c", 10, "Before the clock step %d", i);
+    }
+    realtime_offset = -3600;
+    for(int i = 0; i < CLOCK_STEP_MESSAGES; i++) {
+        VLOG(LOG_MODULE1, VLL_INFO, "test.c", 20, "After the clock step %d", i);
+    }
+    vlog_stop_async();
+
+    /* Messages are dated by the clock as it is when they are written. */
+    assert_true(labs((long)(mktime(&strftime_tm) - realtime_offset - time(NULL))) <= 1);
+    realtime_offset = 0;
+
+    assert_int_equal(file_level_lines[VLL_INFO], 2 * CLOCK_STEP_MESSAGES);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_vlog_init),
@@ -259,6 +617,15 @@ int main(void) {
         cmocka_unit_test_setup_teardown(test_vlog_set_facility_level, setup, teardown),
         cmocka_unit_test_setup_teardown(test_vlog_set_log_file, setup, teardown),
         cmocka_unit_test_setup_teardown(test_vlog_rate_limit, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_rate_limit_subsecond, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_tsc, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_set_levels_from_string, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_set_config_file, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_console_buffer, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_scope, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_async_drop_below, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_async_merge, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_vlog_async_clock_step, setup, teardown),
     };
 
     cmocka_set_message_output(CM_OUTPUT_XML);
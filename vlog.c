@@ -1,14 +1,31 @@
+#define _GNU_SOURCE /* For FNM_CASEFOLD. */
+
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include "vlog.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
 #define LOG_MODULE VLM_vlog
 
 /* Saturating addition: overflow yields UINT_MAX. */
@@ -50,18 +67,203 @@ static struct facility facilities[VLF_N_FACILITIES] = {
 #undef VLOG_FACILITY
 };
 
-/* Current log levels. */
-static int levels[VLM_N_MODULES][VLF_N_FACILITIES];
+/* Name for each backpressure policy. */
+static const char* policy_names[VLP_N_POLICIES] = {
+#define VLOG_POLICY(NAME) #NAME,
+    VLOG_POLICIES
+#undef VLOG_POLICY
+};
+
+/* A complete configuration of log levels and backpressure policies.
+ * 'min_levels' caches, for each module, the most verbose level at which any
+ * facility logs.  For VLP_DROP_BELOW, 'policy_levels' is the least important
+ * level that is never dropped. */
+struct level_table {
+    int levels[VLM_N_MODULES][VLF_N_FACILITIES];
+    enum vlog_policy policies[VLM_N_MODULES];
+    enum vlog_level policy_levels[VLM_N_MODULES];
+    enum vlog_level min_levels[VLM_N_MODULES];
+    struct level_table* next_retired; /* In 'retired_tables'. */
+};
+
+/* Current log levels.  'min_vlog_levels', which the VLOG macros read for
+ * fast checking whether we're logging anything for a given module and level,
+ * points to the 'min_levels' of the current table, and cur_table() finds the
+ * table from it, so that there is just one pointer to the current table.
+ *
+ * vlog_set_levels() and vlog_set_policy() update the current table in place,
+ * but replacing the whole configuration, e.g. from a configuration file,
+ * builds a new table and then publishes it by storing that one pointer, so
+ * that a concurrent reader sees either the old or the new configuration.  A
+ * reader may still be using a replaced table, so replaced tables are only
+ * freed by vlog_exit(); they are small, and replacements are rare.
+ * 'config_mutex' serializes all changes. */
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct level_table default_table;
+static struct level_table* retired_tables;
+enum vlog_level* min_vlog_levels = default_table.min_levels;
+
+/* Returns the current configuration: the table that contains
+ * 'min_vlog_levels'. */
+static struct level_table* cur_table(void) {
+    char* min_levels = (char*)__atomic_load_n(&min_vlog_levels, __ATOMIC_ACQUIRE);
 
-/* For fast checking whether we're logging anything for a given module and
- * level.*/
-enum vlog_level min_vlog_levels[VLM_N_MODULES];
+    return (struct level_table*)(min_levels - offsetof(struct level_table, min_levels));
+}
 
 /* VLF_FILE configuration. */
 static char* log_file_name;
 static FILE* log_file;
 static int log_file_max_size;
 
+/* Serializes writes to the facilities, which may come from the merger thread
+ * and from callers of vlog_set_log_file() at the same time. */
+static pthread_mutex_t sink_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* VLF_CONSOLE configuration, protected by 'sink_mutex'.
+ *
+ * With a nonzero 'console_size', lines for the console collect in
+ * 'console_buf', which holds 'console_len' bytes, and are written together
+ * when the buffer fills up, when a message at VLL_ERR or more severe arrives,
+ * or 'console_flush_ms' after the first buffered line, logged at
+ * 'console_first_ns'.  The background thread enforces the deadline; while
+ * 'console_parked', it is not doing so and needs to be woken up.
+ *
+ * With 'console_color', level names are colored for a terminal. */
+static char* console_buf;
+static size_t console_size;
+static size_t console_len;
+static unsigned int console_flush_ms;
+static uint64_t console_first_ns;
+static bool console_parked = true;
+static bool console_color;
+
+/* Terminal color for each logging level. */
+static const char* level_colors[VLL_N_LEVELS] = {
+    [VLL_EMER] = "\033[1;31m",
+    [VLL_ERR] = "\033[31m",
+    [VLL_WARN] = "\033[33m",
+    [VLL_INFO] = "\033[32m",
+    [VLL_DBG] = "\033[36m",
+};
+#define COLOR_RESET "\033[0m"
+
+/* A single log message on its way to the facilities. */
+struct vlog_record {
+    enum vlog_module module;
+    enum vlog_level level;
+    unsigned int facilities; /* Bitmap of 1u << VLF_*. */
+    const char* file;        /* Must outlive the record, e.g. __FILE__. */
+    int line;
+    uint64_t when; /* From read_clock(). */
+    bool tsc;      /* Whether 'when' is in TSC ticks. */
+    char message[VLOG_MSG_MAX_LEN];
+};
+
+/* Asynchronous logging.  Each producer thread appends records to a shard of
+ * its own, so that producers never contend with each other, and the merger
+ * thread merges the shards by timestamp into the facilities. */
+struct shard {
+    struct shard* next;     /* Next in 'shards'. */
+    pthread_mutex_t mutex;  /* Protects the ring and 'orphaned'. */
+    pthread_cond_t nonfull; /* Signaled when a record leaves the ring. */
+
+    /* Ring of 'size' bytes holding 'count' records, each taking up only as
+     * much room as its message needs, the oldest at offset 'head' and the
+     * next to be added at 'tail'.  A record that does not fit before the end
+     * of the ring goes at its start instead, and then 'wrap' marks the end of
+     * the records before it.  'used' is the number of bytes in records.  The
+     * merger also reads 'count' without 'mutex', as a hint. */
+    char* ring;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t wrap;
+    size_t used;
+    size_t count;
+    bool orphaned; /* The owning thread has exited. */
+
+    /* Owned by the merger: records taken from the ring in one go, back to
+     * back in 'batch', of which those from offset 'batch_off' up to
+     * 'batch_len' are not yet written.  If 'has_next', 'next_rec' points to
+     * the first of those, and 'next_ns' is its time in monotonic_ns(). */
+    char* batch;
+    size_t batch_off;
+    size_t batch_len;
+    const struct vlog_record* next_rec;
+    uint64_t next_ns;
+    bool has_next;
+};
+
+/* Size of each shard's 'batch', in bytes. */
+#define SHARD_BATCH_SIZE 16384
+
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread struct shard* this_shard;
+
+/* All the shards.  Threads add their own shard on first use, but only the
+ * merger removes them, so it may walk the list without 'shards_mutex'. */
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct shard* shards;
+
+/* The merger thread.  Producers signal 'merger_wakeup' only when
+ * 'merger_idle' says that the merger is waiting for new records.
+ * 'merger_wakeup' times out against monotonic_ns(), so it is initialized at
+ * run time. */
+static pthread_once_t merger_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t merger_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merger_wakeup;
+static bool merger_idle;
+static bool async_running;
+static size_t async_size; /* Size of each shard's ring, in bytes. */
+static pthread_t merger_thread;
+
+/* Number of messages dropped because a shard was full, for each module and
+ * level.  'n_reported' is how many of those have already been summarized in
+ * the log, as of 'last_report', in seconds of monotonic_ns() time. */
+static unsigned long long n_dropped[VLM_N_MODULES][VLL_N_LEVELS];
+static unsigned long long n_reported[VLM_N_MODULES][VLL_N_LEVELS];
+static uint64_t last_report;
+
+/* Timestamps.  Messages are stamped with monotonic_ns(), which unlike the
+ * time of day never steps backward, so that the merger can order and hold
+ * back messages by their timestamps.  They are only converted to the time of
+ * day when they are written.
+ *
+ * With 'use_tsc', messages are stamped with raw TSC ticks instead, which are
+ * only converted to monotonic_ns() time when needed, as 'tsc_base_ns' +
+ * (ticks - 'tsc_base') * 'tsc_mult' / 2**32.  'tsc_seq' is a sequence lock
+ * for the conversion parameters, which the background thread recalibrates
+ * against monotonic_ns() every VLOG_TSC_CALIBRATE_INTERVAL seconds, starting
+ * from 'tsc_sample' ticks at 'tsc_sample_ns'. */
+static bool use_tsc;
+static unsigned int tsc_seq;
+static uint64_t tsc_base;
+static uint64_t tsc_base_ns;
+static uint64_t tsc_mult;
+static uint64_t tsc_sample;
+static uint64_t tsc_sample_ns;
+
+/* Background thread for housekeeping, such as TSC calibration, watching the
+ * configuration file, and flushing the console buffer.  Writing to
+ * 'bg_wake_fds[1]' wakes it up; once created, the pipe stays open until
+ * vlog_exit(), so that any thread may do so without locking. */
+static pthread_mutex_t bg_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool bg_running;
+static pthread_t bg_thread;
+static int bg_wake_fds[2] = { -1, -1 };
+
+/* Configuration file, if any, and an inotify instance watching the directory
+ * that contains it, both protected by 'bg_mutex'.  'config_base_name' points
+ * into 'config_file_name'. */
+static char* config_file_name;
+static const char* config_base_name;
+static int config_inotify_fd = -1;
+
+static void bg_wake(void);
+static void bg_stop(void);
+
 /* Searches the 'n_names' in 'names'.  Returns the index of a match for
  * 'target', or 'n_names' if no name matches. */
 static size_t search_name_array(const char* target, const char** names, size_t n_names) {
@@ -119,26 +321,39 @@ enum vlog_module vlog_get_module_val(const char* name) {
     return search_name_array(name, module_names, ARRAY_SIZE(module_names));
 }
 
+/* Returns the name for backpressure policy 'policy'. */
+const char* vlog_get_policy_name(enum vlog_policy policy) {
+    assert(policy < VLP_N_POLICIES);
+    return policy_names[policy];
+}
+
+/* Returns the backpressure policy named 'name', or VLP_N_POLICIES if 'name'
+ * is not the name of a policy. */
+enum vlog_policy vlog_get_policy_val(const char* name) {
+    return search_name_array(name, policy_names, ARRAY_SIZE(policy_names));
+}
+
 /* Returns the current logging level for the given 'module' and 'facility'. */
 enum vlog_level vlog_get_level(enum vlog_module module, enum vlog_facility facility) {
     assert(module < VLM_N_MODULES);
     assert(facility < VLF_N_FACILITIES);
-    return levels[module][facility];
+    return cur_table()->levels[module][facility];
 }
 
-static void update_min_level(enum vlog_module module) {
+static void update_min_level(struct level_table* table, enum vlog_module module) {
     enum vlog_level min_level = VLL_EMER;
     enum vlog_facility facility;
 
     for(facility = 0; facility < VLF_N_FACILITIES; facility++) {
         if(log_file || facility != VLF_FILE) {
-            min_level = MAX(min_level, levels[module][facility]);
+            min_level = MAX(min_level, table->levels[module][facility]);
         }
     }
-    min_vlog_levels[module] = min_level;
+    table->min_levels[module] = min_level;
 }
 
-static void set_facility_level(enum vlog_facility facility,
+static void set_facility_level(struct level_table* table,
+enum vlog_facility facility,
 enum vlog_module module,
 enum vlog_level level) {
     assert(facility >= 0 && facility < VLF_N_FACILITIES);
@@ -146,25 +361,253 @@ enum vlog_level level) {
 
     if(module == VLM_ANY_MODULE) {
         for(module = 0; module < VLM_N_MODULES; module++) {
-            levels[module][facility] = level;
-            update_min_level(module);
+            table->levels[module][facility] = level;
+            update_min_level(table, module);
         }
     } else {
-        levels[module][facility] = level;
-        update_min_level(module);
+        table->levels[module][facility] = level;
+        update_min_level(table, module);
     }
 }
 
-/* Sets the logging level for the given 'module' and 'facility' to 'level'. */
-void vlog_set_levels(enum vlog_module module, enum vlog_facility facility, enum vlog_level level) {
+static void set_levels(struct level_table* table,
+enum vlog_module module,
+enum vlog_facility facility,
+enum vlog_level level) {
     assert(facility < VLF_N_FACILITIES || facility == VLF_ANY_FACILITY);
     if(facility == VLF_ANY_FACILITY) {
         for(facility = 0; facility < VLF_N_FACILITIES; facility++) {
-            set_facility_level(facility, module, level);
+            set_facility_level(table, facility, module, level);
+        }
+    } else {
+        set_facility_level(table, facility, module, level);
+    }
+}
+
+static void set_policy(struct level_table* table,
+enum vlog_module module,
+enum vlog_policy policy,
+enum vlog_level threshold) {
+    assert(module < VLM_N_MODULES || module == VLM_ANY_MODULE);
+    assert(policy < VLP_N_POLICIES);
+    assert(threshold < VLL_N_LEVELS);
+
+    if(module == VLM_ANY_MODULE) {
+        for(module = 0; module < VLM_N_MODULES; module++) {
+            table->policies[module] = policy;
+            table->policy_levels[module] = threshold;
+        }
+    } else {
+        table->policies[module] = policy;
+        table->policy_levels[module] = threshold;
+    }
+}
+
+/* Sets the logging level for the given 'module' and 'facility' to 'level'. */
+void vlog_set_levels(enum vlog_module module, enum vlog_facility facility, enum vlog_level level) {
+    pthread_mutex_lock(&config_mutex);
+    set_levels(cur_table(), module, facility, level);
+    pthread_mutex_unlock(&config_mutex);
+}
+
+/* Makes 'table' the current configuration.  The caller must hold
+ * 'config_mutex'. */
+static void publish_table(struct level_table* table) {
+    struct level_table* old = cur_table();
+    enum vlog_module module;
+
+    for(module = 0; module < VLM_N_MODULES; module++) {
+        update_min_level(table, module);
+    }
+    __atomic_store_n(&min_vlog_levels, table->min_levels, __ATOMIC_RELEASE);
+
+    if(old != &default_table) {
+        old->next_retired = retired_tables;
+        retired_tables = old;
+    }
+}
+
+/* Parses 's' and applies it to 'table', starting from every module logging
+ * at VLL_INFO to every facility, as after vlog_init(), with policy
+ * VLP_BLOCK.  Returns true if successful, otherwise logs why 's' is invalid,
+ * citing 'origin' as its source, and returns false.  See
+ * vlog_set_levels_from_string() for the syntax. */
+static bool parse_levels(const char* origin, const char* s, struct level_table* table) {
+    char* save_ptr = NULL;
+    char* buf = strdup(s);
+    char* entry;
+    char* p;
+    bool ok = true;
+
+    if(!buf) {
+        VLOG_WARN(LOG_MODULE, "%s: %s", origin, strerror(ENOMEM));
+        return false;
+    }
+    set_levels(table, VLM_ANY_MODULE, VLF_ANY_FACILITY, VLL_INFO);
+    set_policy(table, VLM_ANY_MODULE, VLP_BLOCK, VLL_EMER);
+
+    /* Blank out comments. */
+    for(p = strchr(buf, '#'); p; p = strchr(p, '#')) {
+        while(*p && *p != '\n') {
+            *p++ = ' ';
+        }
+    }
+
+    for(entry = strtok_r(buf, ", \t\r\n", &save_ptr); entry;
+    entry = strtok_r(NULL, ", \t\r\n", &save_ptr)) {
+        char* module_name = entry;
+        char* facility_name = strchr(module_name, ':');
+        char* level_name = facility_name ? strchr(facility_name + 1, ':') : NULL;
+        enum vlog_facility facility = VLF_ANY_FACILITY;
+        enum vlog_policy policy = VLP_N_POLICIES;
+        enum vlog_module module;
+        enum vlog_level level;
+        bool matched = false;
+
+        if(!level_name) {
+            VLOG_WARN(LOG_MODULE, "%s: \"%s\" is not of the form module:facility:level",
+            origin, entry);
+            ok = false;
+            break;
+        }
+        *facility_name++ = '\0';
+        *level_name++ = '\0';
+
+        if(!strcasecmp(facility_name, "policy")) {
+            /* "module:policy:name[:threshold]". */
+            char* policy_name = level_name;
+
+            level_name = strchr(policy_name, ':');
+            if(level_name) {
+                *level_name++ = '\0';
+            }
+            policy = vlog_get_policy_val(policy_name);
+            if(policy == VLP_N_POLICIES) {
+                VLOG_WARN(LOG_MODULE, "%s: unknown policy \"%s\"", origin, policy_name);
+                ok = false;
+                break;
+            }
+            if(!level_name) {
+                level_name = "emer";
+            }
+        } else if(strchr(level_name, ':')) {
+            VLOG_WARN(LOG_MODULE, "%s: \"%s:%s:%s\" is not of the form module:facility:level",
+            origin, module_name, facility_name, level_name);
+            ok = false;
+            break;
+        } else if(strcasecmp(facility_name, "any")) {
+            facility = vlog_get_facility_val(facility_name);
+            if(facility == VLF_N_FACILITIES) {
+                VLOG_WARN(LOG_MODULE, "%s: unknown facility \"%s\"", origin, facility_name);
+                ok = false;
+                break;
+            }
+        }
+
+        level = vlog_get_level_val(level_name);
+        if(level == VLL_N_LEVELS) {
+            VLOG_WARN(LOG_MODULE, "%s: unknown level \"%s\"", origin, level_name);
+            ok = false;
+            break;
+        }
+
+        for(module = 0; module < VLM_N_MODULES; module++) {
+            if(!strcasecmp(module_name, "any")
+            || !fnmatch(module_name, vlog_get_module_name(module), FNM_CASEFOLD)) {
+                if(policy != VLP_N_POLICIES) {
+                    set_policy(table, module, policy, level);
+                } else {
+                    set_levels(table, module, facility, level);
+                }
+                matched = true;
+            }
+        }
+        if(!matched) {
+            VLOG_WARN(LOG_MODULE, "%s: \"%s\" matches no module", origin, module_name);
+            ok = false;
+            break;
         }
+    }
+
+    free(buf);
+    return ok;
+}
+
+/* Implements vlog_set_levels_from_string(), citing 'origin' as the source of
+ * 's' in diagnostics. */
+static int set_levels_from_string(const char* origin, const char* s) {
+    struct level_table* table = malloc(sizeof *table);
+    int error = 0;
+
+    if(!table) {
+        return ENOMEM;
+    }
+
+    pthread_mutex_lock(&config_mutex);
+    if(parse_levels(origin, s, table)) {
+        publish_table(table);
     } else {
-        set_facility_level(facility, module, level);
+        free(table);
+        error = EINVAL;
     }
+    pthread_mutex_unlock(&config_mutex);
+
+    return error;
+}
+
+/* Replaces the whole logging level configuration by the one in 's', a list
+ * of entries of the form "module:facility:level" separated by commas or
+ * white space, in which '#' starts a comment that extends to the end of the
+ * line.  'module' is a module name or a shell wildcard pattern that matches
+ * module names, and 'facility' is a facility name.  Either may be "any".
+ * An entry of the form "module:policy:name[:threshold]" instead sets the
+ * backpressure policy, as vlog_set_policy() does.  Levels not set by any
+ * entry are VLL_INFO, policies are VLP_BLOCK, and later entries override
+ * earlier ones.  For example:
+ *
+ *     vlog:file:dbg, test_vlog*:console:warn, test_vlog1:policy:drop_below:err
+ *
+ * Concurrent log calls see either the old or the new configuration, never a
+ * mixture.  Returns 0 if successful.  If 's' is invalid, logs the reason,
+ * leaves the configuration unchanged, and returns EINVAL. */
+int vlog_set_levels_from_string(const char* s) {
+    return set_levels_from_string("configuration", s);
+}
+
+/* Returns the current backpressure policy for the given 'module'. */
+enum vlog_policy vlog_get_policy(enum vlog_module module) {
+    assert(module < VLM_N_MODULES);
+    return cur_table()->policies[module];
+}
+
+/* Sets the backpressure policy for the given 'module' to 'policy'.  When the
+ * asynchronous log queue is full:
+ *
+ *   - VLP_BLOCK makes the caller wait for room.
+ *
+ *   - VLP_DROP_NEWEST drops the new message.
+ *
+ *   - VLP_DROP_OLDEST drops the oldest queued message to make room, if that
+ *     message's own module's policy allows dropping it, and otherwise drops
+ *     the new message.
+ *
+ *   - VLP_DROP_BELOW drops messages less important than 'threshold' as soon
+ *     as the queue is three-quarters full, to keep room for the rest, which
+ *     wait for room like VLP_BLOCK.
+ *
+ * 'threshold' is ignored by the other policies. */
+void vlog_set_policy(enum vlog_module module, enum vlog_policy policy, enum vlog_level threshold) {
+    pthread_mutex_lock(&config_mutex);
+    set_policy(cur_table(), module, policy, threshold);
+    pthread_mutex_unlock(&config_mutex);
+}
+
+/* Returns the number of messages for 'module' at 'level' dropped so far
+ * because the asynchronous log queue was full. */
+unsigned long long vlog_get_dropped(enum vlog_module module, enum vlog_level level) {
+    assert(module < VLM_N_MODULES);
+    assert(level < VLL_N_LEVELS);
+    return __atomic_load_n(&n_dropped[module][level], __ATOMIC_RELAXED);
 }
 
 /* Returns the name of the log file used by VLF_FILE, or a null pointer if no
@@ -188,6 +631,9 @@ int vlog_set_log_file(const char* file_name, int max_size) {
     /* Close old log file. */
     if(log_file) {
         VLOG_INFO(LOG_MODULE, "closing log file");
+    }
+    pthread_mutex_lock(&sink_mutex);
+    if(log_file) {
         fclose(log_file);
         log_file = NULL;
     }
@@ -199,22 +645,27 @@ int vlog_set_log_file(const char* file_name, int max_size) {
     free(old_log_file_name);
     file_name = NULL; /* Might have been freed. */
 
-    /* Open new log file and update min_levels[] to reflect whether we actually
-     * have a log_file. */
+    /* Open new log file. */
     log_file = fopen(log_file_name, "a");
+    error = log_file ? 0 : errno;
+    if(log_file) {
+        log_file_max_size = max_size;
+    }
+    pthread_mutex_unlock(&sink_mutex);
+
+    /* Update min_levels[] to reflect whether we actually have a log_file. */
+    pthread_mutex_lock(&config_mutex);
     for(module = 0; module < VLM_N_MODULES; module++) {
-        update_min_level(module);
+        update_min_level(cur_table(), module);
     }
+    pthread_mutex_unlock(&config_mutex);
 
     /* Log success or failure. */
     if(!log_file) {
         VLOG_WARN(LOG_MODULE, "failed to open %s for logging: %s",
-        log_file_name, strerror(errno));
-        error = errno;
+        log_file_name, strerror(error));
     } else {
         VLOG_INFO(LOG_MODULE, "opened log file %s with max size %d", log_file_name, max_size);
-        log_file_max_size = max_size;
-        error = 0;
     }
 
     return error;
@@ -227,6 +678,40 @@ void vlog_init(void) {
 
 /* Closes the logging subsystem. */
 void vlog_exit(void) {
+    struct level_table* table;
+
+    vlog_stop_async();
+    bg_stop();
+    __atomic_store_n(&use_tsc, false, __ATOMIC_RELAXED);
+
+    vlog_set_console_buffer(0, 0);
+
+    /* With the background thread stopped and console buffering off, no other
+     * thread writes to the wake pipe any more. */
+    if(bg_wake_fds[0] >= 0) {
+        close(__atomic_exchange_n(&bg_wake_fds[1], -1, __ATOMIC_ACQ_REL));
+        close(bg_wake_fds[0]);
+        bg_wake_fds[0] = -1;
+    }
+
+    /* Move the configuration back into 'default_table', so that the other
+     * tables can be freed. */
+    pthread_mutex_lock(&config_mutex);
+    table = cur_table();
+    if(table != &default_table) {
+        memcpy(default_table.levels, table->levels, sizeof default_table.levels);
+        memcpy(default_table.policies, table->policies, sizeof default_table.policies);
+        memcpy(default_table.policy_levels, table->policy_levels,
+        sizeof default_table.policy_levels);
+        publish_table(&default_table);
+    }
+    while(retired_tables) {
+        table = retired_tables;
+        retired_tables = table->next_retired;
+        free(table);
+    }
+    pthread_mutex_unlock(&config_mutex);
+
     if(log_file) {
         fclose(log_file);
         log_file = NULL;
@@ -244,98 +729,1762 @@ bool vlog_is_enabled(enum vlog_module module, enum vlog_level level) {
     return min_vlog_levels[module] >= level;
 }
 
-/* Writes 'message' to the log at the given 'level' and as coming from the
- * given 'module'.
- *
- * Guaranteed to preserve errno. */
-void vlog_valist(enum vlog_module module,
-enum vlog_level level,
-const char* file,
-int line,
-time_t now,
-const char* message,
-va_list args) {
-    bool log_to_console = levels[module][VLF_CONSOLE] >= level;
-    bool log_to_file = levels[module][VLF_FILE] >= level && log_file;
+/* Returns a bitmap of the facilities, as 1u << VLF_*, to which a message for
+ * the given 'module' and 'level' should be written according to 'table'. */
+static unsigned int get_facilities(const struct level_table* table,
+enum vlog_module module,
+enum vlog_level level) {
+    unsigned int facilities = 0;
+    enum vlog_facility facility;
 
-    if(log_to_console || log_to_file) {
-        int save_errno = errno;
-        struct tm time;
-        char buf[VLOG_MSG_MAX_LEN] = { 0 };
-        size_t off = 0;
-        const char* module_name = vlog_get_module_name(module);
-        const char* level_name = vlog_get_level_name(level);
-        int fd;
-        int file_size;
-
-        localtime_r(&now, &time);
-
-        off = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &time);
-        off += snprintf(buf + off, sizeof(buf) - off,
-        " %-5s %-5s %s:%d: ", level_name, module_name, file, line);
-        off += vsnprintf(buf + off, sizeof(buf) - off, message, args);
-        if(off >= sizeof(buf)) {
-            off = sizeof(buf) - 1;
-        }
-        buf[off++] = '\n';
-        buf[off] = '\0';
-
-        if(log_to_console) {
-            fputs(buf, stderr);
-            fflush(stderr);
+    for(facility = 0; facility < VLF_N_FACILITIES; facility++) {
+        if(table->levels[module][facility] >= (int)level && (log_file || facility != VLF_FILE)) {
+            facilities |= 1u << facility;
         }
-        if(log_to_file) {
-            if(log_file_max_size > 0) {
-                fseek(log_file, 0L, SEEK_END);
-                file_size = ftell(log_file);
-                if(file_size > log_file_max_size) {
-                    fd = fileno(log_file);
-                    ftruncate(fd, 0);
-                    rewind(log_file);
-                }
+    }
+    return facilities;
+}
+
+static uint64_t timespec_to_ns(const struct timespec* ts) {
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* Returns the current time, in nanoseconds since some fixed point in the
+ * past, on a clock that never steps, even when the time of day does. */
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_ns(&ts);
+}
+
+/* Converts 'ns', a time from monotonic_ns(), into nanoseconds since the
+ * epoch, as the system clock currently tells the time of day. */
+static uint64_t monotonic_to_wall(uint64_t ns) {
+    struct timespec mono, wall;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    return ns + (timespec_to_ns(&wall) - timespec_to_ns(&mono));
+}
+
+/* Returns true if the CPU has a TSC that ticks at a constant rate and keeps
+ * ticking in deep sleep states, so that it can serve as a clock. */
+static bool have_invariant_tsc(void) {
+#if HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+
+    return __get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) && eax >= 0x80000007
+    && __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && edx & (1u << 8);
+#else
+    return false;
+#endif
+}
+
+static uint64_t read_tsc(void) {
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Returns the current time, as TSC ticks if 'tsc', otherwise as
+ * monotonic_ns() does. */
+static inline uint64_t read_clock(bool tsc) {
+    return tsc ? read_tsc() : monotonic_ns();
+}
+
+/* Returns 'a' * 'b' / 2**32, computed piecewise so that the intermediate
+ * product does not overflow even without a 128-bit integer type. */
+static uint64_t mul_shr32(uint64_t a, uint64_t b) {
+    uint64_t a_hi = a >> 32, a_lo = a & 0xffffffff;
+    uint64_t b_hi = b >> 32, b_lo = b & 0xffffffff;
+
+    return ((a_hi * b_hi) << 32) + a_hi * b_lo + a_lo * b_hi + ((a_lo * b_lo) >> 32);
+}
+
+/* Converts 'ticks' of the TSC into monotonic_ns() time. */
+static uint64_t tsc_to_ns(uint64_t ticks) {
+    uint64_t base, base_ns, mult;
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&tsc_seq, __ATOMIC_ACQUIRE);
+        base = __atomic_load_n(&tsc_base, __ATOMIC_RELAXED);
+        base_ns = __atomic_load_n(&tsc_base_ns, __ATOMIC_RELAXED);
+        mult = __atomic_load_n(&tsc_mult, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(seq & 1 || seq != __atomic_load_n(&tsc_seq, __ATOMIC_RELAXED));
+
+    if(ticks >= base) {
+        return base_ns + mul_shr32(ticks - base, mult);
+    } else {
+        return base_ns - mul_shr32(base - ticks, mult);
+    }
+}
+
+/* Converts 'when', as returned by read_clock('tsc'), into monotonic_ns()
+ * time. */
+static uint64_t clock_to_ns(uint64_t when, bool tsc) {
+    return tsc ? tsc_to_ns(when) : when;
+}
+
+/* Reads the TSC and monotonic_ns() at nearly the same moment, into '*ticks'
+ * and '*ns'. */
+static void tsc_read_pair(uint64_t* ticks, uint64_t* ns) {
+    uint64_t best = UINT64_MAX;
+    uint64_t before, after, now;
+    int i;
+
+    /* Keep the tightest of a few tries, to avoid an interrupt or preemption
+     * between the reads skewing the result. */
+    for(i = 0; i < 5; i++) {
+        before = read_tsc();
+        now = monotonic_ns();
+        after = read_tsc();
+        if(after - before < best) {
+            best = after - before;
+            *ticks = before + (after - before) / 2;
+            *ns = now;
+        }
+    }
+}
+
+/* Calibrates the TSC against monotonic_ns(), based on how far each has
+ * advanced since the last call.  A call with no earlier sample, that is,
+ * with 'tsc_sample' zero, only takes one.  The caller must hold 'bg_mutex'.
+ *
+ * Conversions stay continuous across a recalibration: the rate for the next
+ * interval is adjusted to make up for the drift of the last one, unless the
+ * two clocks disagree by a second or more, in which case the conversion
+ * jumps to monotonic_ns(). */
+static void tsc_calibrate(void) {
+    uint64_t ticks = 0, ns = 0, base_ns, mult;
+    int64_t error, adjust;
+
+    tsc_read_pair(&ticks, &ns);
+    if(!tsc_sample || ticks <= tsc_sample || ns <= tsc_sample_ns) {
+        tsc_sample = ticks;
+        tsc_sample_ns = ns;
+        return;
+    }
+
+    /* A double is precise enough for the rate, and unlike a 128-bit integer
+     * is available on 32-bit targets. */
+    mult = (ns - tsc_sample_ns) * 4294967296.0 / (ticks - tsc_sample);
+    base_ns = ns;
+    if(tsc_mult) {
+        error = ns - tsc_to_ns(ticks);
+        if(error > -1000000000 && error < 1000000000) {
+            adjust = (error * ((int64_t)1 << 32)) / (int64_t)(ticks - tsc_sample);
+            if((int64_t)mult + adjust > 0) {
+                base_ns = ns - error;
+                mult += adjust;
             }
+        }
+    }
 
-            fputs(buf, log_file);
-            fflush(log_file);
+    __atomic_store_n(&tsc_seq, tsc_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&tsc_base, ticks, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc_base_ns, base_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc_mult, mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc_seq, tsc_seq + 1, __ATOMIC_RELEASE);
+
+    tsc_sample = ticks;
+    tsc_sample_ns = ns;
+}
+
+/* Writes out the console buffer.  The caller must hold 'sink_mutex'. */
+static void console_flush(void) {
+    if(console_len) {
+        fputs(console_buf, stderr);
+        fflush(stderr);
+        console_len = 0;
+        console_buf[0] = '\0';
+    }
+}
+
+/* Copies 'line', which is 'len' bytes long and has the name of 'level' at
+ * offset 'level_off', into 'dst', coloring the level name.  Returns the
+ * number of bytes copied, not counting the null terminator. */
+static size_t console_colorize(char* dst, const char* line, size_t len, size_t level_off, enum vlog_level level) {
+    size_t name_len = strlen(vlog_get_level_name(level));
+    size_t color_len = strlen(level_colors[level]);
+    char* p = dst;
+
+    memcpy(p, line, level_off);
+    p += level_off;
+    memcpy(p, level_colors[level], color_len);
+    p += color_len;
+    memcpy(p, line + level_off, name_len);
+    p += name_len;
+    memcpy(p, COLOR_RESET, strlen(COLOR_RESET));
+    p += strlen(COLOR_RESET);
+    memcpy(p, line + level_off + name_len, len - level_off - name_len + 1);
+    return p - dst + len - level_off - name_len;
+}
+
+/* Writes 'line', which is 'len' bytes long and has the name of 'level' at
+ * offset 'level_off', to the console, or adds it to the console buffer.  The
+ * caller must hold 'sink_mutex'.  Returns true if the background thread must
+ * be woken up to flush the buffer in time. */
+static bool console_write(const char* line, size_t len, size_t level_off, enum vlog_level level, bool flush) {
+    size_t max_len = len + (console_color ? strlen(level_colors[level]) + strlen(COLOR_RESET) : 0);
+    char colored[VLOG_MSG_MAX_LEN + 16];
+    bool wake = false;
+
+    if(max_len >= console_size) {
+        /* Not buffering, or the line would not fit anyway. */
+        console_flush();
+        if(console_color) {
+            console_colorize(colored, line, len, level_off, level);
+            line = colored;
         }
+        fputs(line, stderr);
+        if(flush) {
+            fflush(stderr);
+        }
+        return false;
+    }
 
-        errno = save_errno;
+    if(console_len + max_len >= console_size) {
+        console_flush();
     }
+    if(!console_len) {
+        console_first_ns = monotonic_ns();
+        wake = console_parked;
+        console_parked = false;
+    }
+    if(console_color) {
+        console_len += console_colorize(console_buf + console_len, line, len, level_off, level);
+    } else {
+        memcpy(console_buf + console_len, line, len + 1);
+        console_len += len;
+    }
+
+    if(level <= VLL_ERR) {
+        console_flush();
+    }
+    return wake;
 }
 
-void vlog(enum vlog_module module, enum vlog_level level, const char* file, int line, const char* message, ...) {
-    va_list args;
-    time_t now = time(NULL);
-    va_start(args, message);
-    vlog_valist(module, level, file, line, now, message, args);
-    va_end(args);
+/* Flushes the console buffer if its deadline has passed as of 'now'.  The
+ * caller must hold 'sink_mutex'.  Returns the time by which the buffer must
+ * next be checked, or UINT64_MAX if it is empty, in which case
+ * console_write() will wake the background thread when that changes. */
+static uint64_t console_tick(uint64_t now) {
+    uint64_t flush_ns = (uint64_t)console_flush_ms * 1000000;
+    uint64_t deadline = UINT64_MAX;
+
+    if(console_len) {
+        deadline = console_first_ns + flush_ns;
+        if(now >= deadline) {
+            /* Check again a period later rather than parking, so that steady
+             * logging never has to wake up the background thread. */
+            console_flush();
+            deadline = now + flush_ns;
+        }
+    } else {
+        console_parked = true;
+    }
+    return deadline;
 }
 
-void vlog_rate_limit(enum vlog_module module,
-enum vlog_level level,
-const char* file,
-int line,
-struct vlog_rate_limit* rl,
-const char* message,
-...) {
-    va_list args;
+/* Reads the configuration file 'file_name' and applies it.  Returns 0 if
+ * successful, otherwise a positive errno value. */
+static int load_config_file(const char* file_name) {
+    size_t size = 0;
+    size_t allocated = 4096;
+    char* buf = malloc(allocated);
+    ssize_t n;
+    int error;
+    int fd;
 
-    if(!vlog_is_enabled(module, level)) {
-        return;
+    fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || !buf) {
+        error = fd < 0 ? errno : ENOMEM;
+        VLOG_WARN(LOG_MODULE, "%s: could not read configuration: %s",
+        file_name, strerror(error));
+        if(fd >= 0) {
+            close(fd);
+        }
+        free(buf);
+        return error;
     }
 
-    time_t now = time(NULL);
+    while((n = read(fd, buf + size, allocated - size - 1)) > 0) {
+        size += n;
+        if(allocated - size == 1) {
+            char* new_buf = realloc(buf, allocated * 2);
+            if(!new_buf) {
+                n = -1;
+                errno = ENOMEM;
+                break;
+            }
+            buf = new_buf;
+            allocated *= 2;
+        }
+    }
+    if(n < 0) {
+        error = errno;
+        VLOG_WARN(LOG_MODULE, "%s: could not read configuration: %s",
+        file_name, strerror(error));
+    } else {
+        buf[size] = '\0';
+        error = set_levels_from_string(file_name, buf);
+    }
 
-    if(rl->tokens < VLOG_MSG_TOKENS) {
-        if(rl->last_fill > now) {
-            /* Last filled in the future?  Time must have gone backward, or
-             * 'rl' has not been used before. */
-            rl->tokens = rl->burst;
-        } else if(rl->last_fill < now) {
-            unsigned int add = sat_mul(rl->rate, now - rl->last_fill);
-            unsigned int tokens = sat_add(rl->tokens, add);
-            rl->tokens = MIN(tokens, rl->burst);
-            rl->last_fill = now;
+    close(fd);
+    free(buf);
+    return error;
+}
+
+/* Reads the pending events from 'config_inotify_fd' and returns true if any
+ * of them says that the configuration file was written or replaced.  The
+ * caller must hold 'bg_mutex'. */
+static bool config_file_changed(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    bool changed = false;
+    ssize_t n;
+    char* p;
+
+    while((n = read(config_inotify_fd, buf, sizeof buf)) > 0) {
+        for(p = buf; p < buf + n; p += sizeof *event + event->len) {
+            event = (const struct inotify_event*)p;
+            if(event->len && !strcmp(event->name, config_base_name)) {
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+/* Body of the background thread. */
+static void* bg_main(void* arg) {
+    const uint64_t interval = (uint64_t)VLOG_TSC_CALIBRATE_INTERVAL * 1000000000;
+    uint64_t next_calibration = monotonic_ns() + interval;
+    uint64_t deadline;
+    struct pollfd fds[2];
+    char buf[64];
+    uint64_t now;
+
+    pthread_mutex_lock(&bg_mutex);
+    while(bg_running) {
+        fds[0].fd = bg_wake_fds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = config_inotify_fd;
+        fds[1].events = POLLIN;
+
+        now = monotonic_ns();
+        pthread_mutex_lock(&sink_mutex);
+        deadline = MIN(next_calibration, console_tick(now));
+        pthread_mutex_unlock(&sink_mutex);
+
+        pthread_mutex_unlock(&bg_mutex);
+        poll(fds, 2, deadline > now ? (deadline - now + 999999) / 1000000 : 0);
+        pthread_mutex_lock(&bg_mutex);
+
+        if(fds[0].revents & POLLIN) {
+            while(read(bg_wake_fds[0], buf, sizeof buf) > 0) {
+                continue;
+            }
+        }
+        if(fds[1].revents & POLLIN && fds[1].fd == config_inotify_fd
+        && config_file_changed()) {
+            load_config_file(config_file_name);
+        }
+
+        now = monotonic_ns();
+        if(now >= next_calibration) {
+            if(use_tsc) {
+                tsc_calibrate();
+            }
+            next_calibration = now + interval;
+        }
+    }
+    pthread_mutex_unlock(&bg_mutex);
+    return NULL;
+}
+
+/* Wakes up the background thread, so that it notices changes to its
+ * configuration. */
+static void bg_wake(void) {
+    int fd = __atomic_load_n(&bg_wake_fds[1], __ATOMIC_ACQUIRE);
+
+    if(fd >= 0) {
+        write(fd, "", 1);
+    }
+}
+
+/* Starts the background thread, if it is not already running.  The caller
+ * must hold 'bg_mutex'.  Returns 0 if successful, otherwise a positive errno
+ * value. */
+static int bg_start(void) {
+    int error;
+
+    if(bg_running) {
+        return 0;
+    }
+    if(bg_wake_fds[0] < 0) {
+        int fds[2];
+
+        if(pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+            return errno;
+        }
+        bg_wake_fds[0] = fds[0];
+        __atomic_store_n(&bg_wake_fds[1], fds[1], __ATOMIC_RELEASE);
+    }
+
+    bg_running = true;
+    error = pthread_create(&bg_thread, NULL, bg_main, NULL);
+    if(error) {
+        bg_running = false;
+    }
+    return error;
+}
+
+/* Stops watching the configuration file, if any.  The caller must hold
+ * 'bg_mutex'. */
+static void config_unwatch(void) {
+    if(config_inotify_fd >= 0) {
+        close(config_inotify_fd);
+        config_inotify_fd = -1;
+    }
+    free(config_file_name);
+    config_file_name = NULL;
+    config_base_name = NULL;
+}
+
+/* Stops the background thread, if it is running, and with it watching the
+ * configuration file. */
+static void bg_stop(void) {
+    bool running;
+
+    pthread_mutex_lock(&bg_mutex);
+    running = bg_running;
+    bg_running = false;
+    bg_wake();
+    config_unwatch();
+    pthread_mutex_unlock(&bg_mutex);
+
+    if(running) {
+        pthread_join(bg_thread, NULL);
+    }
+}
+
+/* Copies 'src' into 'dst', skipping the unused tail of the message. */
+static void copy_record(struct vlog_record* dst, const struct vlog_record* src) {
+    memcpy(dst, src, offsetof(struct vlog_record, message) + strlen(src->message) + 1);
+}
+
+/* Returns the number of bytes that copy_record() copies from 'rec', rounded
+ * up so that a record that follows it in a shard's ring is aligned. */
+static size_t record_size(const struct vlog_record* rec) {
+    const size_t align = __alignof__(struct vlog_record);
+    size_t size = offsetof(struct vlog_record, message) + strlen(rec->message) + 1;
+
+    return (size + align - 1) / align * align;
+}
+
+/* Formats 'rec' and writes it to each of its facilities.  Unless 'flush' is
+ * true, the output may stay buffered until the next flush_facilities(). */
+static void write_record(const struct vlog_record* rec, bool flush) {
+    /* localtime_r() takes a process-wide lock, so only call it once a second
+     * in each thread. */
+    static __thread time_t cached_now = -1;
+    static __thread struct tm cached_time;
+    time_t now = monotonic_to_wall(clock_to_ns(rec->when, rec->tsc)) / 1000000000;
+    char buf[VLOG_MSG_MAX_LEN];
+    size_t level_off;
+    size_t off;
+    bool wake = false;
+    int fd;
+    int file_size;
+
+    if(now != cached_now) {
+        localtime_r(&now, &cached_time);
+        cached_now = now;
+    }
+
+    off = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &cached_time);
+    level_off = off + 1;
+    off += snprintf(buf + off, sizeof(buf) - off, " %-5s %-5s %s:%d: ",
+    vlog_get_level_name(rec->level), vlog_get_module_name(rec->module),
+    rec->file, rec->line);
+    if(off < sizeof(buf)) {
+        off += snprintf(buf + off, sizeof(buf) - off, "%s", rec->message);
+    }
+    if(off > sizeof(buf) - 2) {
+        off = sizeof(buf) - 2;
+    }
+    buf[off++] = '\n';
+    buf[off] = '\0';
+
+    pthread_mutex_lock(&sink_mutex);
+    if(rec->facilities & (1u << VLF_CONSOLE)) {
+        wake = console_write(buf, off, level_off, rec->level, flush);
+    }
+    if(rec->facilities & (1u << VLF_FILE) && log_file) {
+        if(log_file_max_size > 0) {
+            fseek(log_file, 0L, SEEK_END);
+            file_size = ftell(log_file);
+            if(file_size > log_file_max_size) {
+                fd = fileno(log_file);
+                ftruncate(fd, 0);
+                rewind(log_file);
+            }
+        }
+
+        fputs(buf, log_file);
+        if(flush) {
+            fflush(log_file);
+        }
+    }
+    pthread_mutex_unlock(&sink_mutex);
+
+    if(wake) {
+        bg_wake();
+    }
+}
+
+/* Flushes output buffered by write_record(). */
+static void flush_facilities(void) {
+    pthread_mutex_lock(&sink_mutex);
+    fflush(stderr);
+    if(log_file) {
+        fflush(log_file);
+    }
+    pthread_mutex_unlock(&sink_mutex);
+}
+
+static bool is_async_running(void) {
+    return __atomic_load_n(&async_running, __ATOMIC_ACQUIRE);
+}
+
+/* Called when a thread with a shard exits.  The merger frees the shard once
+ * it has written out the shard's records. */
+static void shard_orphan(void* shard_) {
+    struct shard* shard = shard_;
+
+    pthread_mutex_lock(&shard->mutex);
+    shard->orphaned = true;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void shard_key_create(void) {
+    pthread_key_create(&shard_key, shard_orphan);
+}
+
+/* Returns the calling thread's shard, creating it if necessary, or a null
+ * pointer if memory is exhausted. */
+static struct shard* get_shard(void) {
+    struct shard* shard = this_shard;
+
+    if(!shard) {
+        shard = calloc(1, sizeof *shard);
+        if(!shard) {
+            return NULL;
+        }
+        shard->batch = malloc(SHARD_BATCH_SIZE);
+        if(!shard->batch) {
+            free(shard);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->nonfull, NULL);
+
+        pthread_once(&shard_once, shard_key_create);
+        pthread_setspecific(shard_key, shard);
+
+        pthread_mutex_lock(&shards_mutex);
+        shard->next = shards;
+        __atomic_store_n(&shards, shard, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&shards_mutex);
+
+        this_shard = shard;
+    }
+    return shard;
+}
+
+/* Makes sure that 'shard' has a ring of 'async_size' bytes.  The caller
+ * must hold the shard's mutex.  Returns false if memory is exhausted. */
+static bool shard_reserve(struct shard* shard) {
+    if(shard->size != async_size) {
+        /* Only an empty ring, left over from a previous vlog_start_async(),
+         * can have the wrong size. */
+        assert(!shard->count);
+        free(shard->ring);
+        shard->ring = malloc(async_size);
+        shard->size = shard->ring ? async_size : 0;
+    }
+    return shard->ring != NULL;
+}
+
+/* Returns the offset in 'shard''s ring at which a record of 'size' bytes
+ * would go, or SIZE_MAX if there is no room for it.  The caller must hold
+ * the shard's mutex. */
+static size_t shard_room(const struct shard* shard, size_t size) {
+    if(!shard->count) {
+        return size <= shard->size ? 0 : SIZE_MAX;
+    } else if(shard->tail > shard->head) {
+        /* The records do not wrap around, so there is room after them and
+         * before them. */
+        if(shard->size - shard->tail >= size) {
+            return shard->tail;
+        }
+        return shard->head >= size ? 0 : SIZE_MAX;
+    } else {
+        return shard->head - shard->tail >= size ? shard->tail : SIZE_MAX;
+    }
+}
+
+/* Adds 'rec', which takes up 'size' bytes, at offset 'ofs' in 'shard''s ring,
+ * as returned by shard_room().  The caller must hold the shard's mutex. */
+static void shard_push(struct shard* shard, size_t ofs, const struct vlog_record* rec, size_t size) {
+    if(!shard->count) {
+        shard->head = ofs;
+        shard->wrap = shard->size;
+    } else if(ofs < shard->tail) {
+        shard->wrap = shard->tail;
+    }
+    copy_record((struct vlog_record*)(shard->ring + ofs), rec);
+    shard->tail = ofs + size;
+    shard->used += size;
+    __atomic_store_n(&shard->count, shard->count + 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the oldest record in 'shard''s ring, which must not be empty.  The
+ * caller must hold the shard's mutex. */
+static const struct vlog_record* shard_peek(const struct shard* shard) {
+    return (const struct vlog_record*)(shard->ring + shard->head);
+}
+
+/* Removes the oldest record from 'shard''s ring, which must not be empty.
+ * The caller must hold the shard's mutex. */
+static void shard_pop(struct shard* shard) {
+    size_t size = record_size(shard_peek(shard));
+
+    shard->head += size;
+    shard->used -= size;
+    if(shard->head == shard->wrap) {
+        shard->head = 0;
+        shard->wrap = shard->size;
+    }
+    __atomic_store_n(&shard->count, shard->count - 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns true if the backpressure policy of 'rec''s module allows dropping
+ * 'rec' from a full shard to make room for a newer message. */
+static bool may_evict(const struct level_table* table, const struct vlog_record* rec) {
+    enum vlog_policy policy = table->policies[rec->module];
+
+    return policy == VLP_DROP_OLDEST
+    || (policy == VLP_DROP_BELOW && rec->level > table->policy_levels[rec->module]);
+}
+
+/* Passes 'rec' to the merger thread through the calling thread's shard,
+ * first applying the backpressure policy of its module if the shard is full.
+ * Returns false if asynchronous logging is not running, in which case the
+ * caller must write 'rec' itself. */
+static bool queue_record(const struct vlog_record* rec) {
+    const struct level_table* table = cur_table();
+    enum vlog_policy policy = table->policies[rec->module];
+    const struct vlog_record* oldest;
+    size_t size = record_size(rec);
+    struct shard* shard;
+    bool drop = false;
+    size_t ofs;
+
+    if(!is_async_running() || !(shard = get_shard())) {
+        return false;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    if(!is_async_running() || !shard_reserve(shard)) {
+        pthread_mutex_unlock(&shard->mutex);
+        return false;
+    }
+
+    ofs = shard_room(shard, size);
+    if(policy == VLP_DROP_BELOW && rec->level > table->policy_levels[rec->module]) {
+        drop = shard->used + size > shard->size - shard->size / 4;
+    } else if(ofs == SIZE_MAX && policy == VLP_DROP_NEWEST) {
+        drop = true;
+    } else if(ofs == SIZE_MAX && policy == VLP_DROP_OLDEST) {
+        /* Only make room at the expense of messages that their own modules'
+         * policies allow dropping, otherwise drop the new message instead. */
+        while(ofs == SIZE_MAX && shard->count && may_evict(table, oldest = shard_peek(shard))) {
+            __atomic_fetch_add(&n_dropped[oldest->module][oldest->level], 1, __ATOMIC_RELAXED);
+            shard_pop(shard);
+            ofs = shard_room(shard, size);
+        }
+        drop = ofs == SIZE_MAX;
+    }
+    while(!drop && is_async_running() && ofs == SIZE_MAX) {
+        pthread_cond_wait(&shard->nonfull, &shard->mutex);
+        ofs = shard_room(shard, size);
+    }
+
+    if(!is_async_running()) {
+        pthread_mutex_unlock(&shard->mutex);
+        return false;
+    }
+    if(drop) {
+        __atomic_fetch_add(&n_dropped[rec->module][rec->level], 1, __ATOMIC_RELAXED);
+    } else {
+        shard_push(shard, ofs, rec, size);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if(!drop && __atomic_load_n(&merger_idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&merger_mutex);
+        pthread_cond_signal(&merger_wakeup);
+        pthread_mutex_unlock(&merger_mutex);
+    }
+    return true;
+}
+
+/* Makes the oldest record in 'shard' that is not yet written, if any, its
+ * 'next_rec'.  Takes records out of the ring a batch at a time, so that the
+ * merger contends with the producer for the shard's mutex once per batch
+ * rather than once per record. */
+static void shard_refill(struct shard* shard) {
+    const struct vlog_record* rec;
+    size_t size;
+
+    if(shard->has_next) {
+        return;
+    }
+    if(shard->batch_off >= shard->batch_len) {
+        if(!__atomic_load_n(&shard->count, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+
+        shard->batch_off = shard->batch_len = 0;
+        pthread_mutex_lock(&shard->mutex);
+        while(shard->count) {
+            rec = shard_peek(shard);
+            size = record_size(rec);
+            if(shard->batch_len + size > SHARD_BATCH_SIZE) {
+                break;
+            }
+            copy_record((struct vlog_record*)(shard->batch + shard->batch_len), rec);
+            shard->batch_len += size;
+            shard_pop(shard);
+        }
+        pthread_cond_signal(&shard->nonfull);
+        pthread_mutex_unlock(&shard->mutex);
+
+        if(!shard->batch_len) {
+            return;
+        }
+    }
+
+    shard->next_rec = (const struct vlog_record*)(shard->batch + shard->batch_off);
+    shard->next_ns = clock_to_ns(shard->next_rec->when, shard->next_rec->tsc);
+    shard->has_next = true;
+}
+
+/* Returns true if any shard might hold a record.  With 'sync', also makes
+ * sure that no producer that saw asynchronous logging running is still
+ * adding a record. */
+static bool shards_pending(bool sync) {
+    struct shard* shard;
+    bool pending = false;
+
+    for(shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+        if(sync) {
+            pthread_mutex_lock(&shard->mutex);
+            pthread_mutex_unlock(&shard->mutex);
+        }
+        pending |= shard->batch_off < shard->batch_len
+        || __atomic_load_n(&shard->count, __ATOMIC_SEQ_CST);
+    }
+    return pending;
+}
+
+/* Frees the shards of exited threads whose records have all been written. */
+static void reap_shards(void) {
+    struct shard** prev;
+    struct shard* shard;
+    bool reap;
+
+    pthread_mutex_lock(&shards_mutex);
+    prev = &shards;
+    while((shard = *prev) != NULL) {
+        pthread_mutex_lock(&shard->mutex);
+        reap = shard->orphaned && !shard->count && shard->batch_off >= shard->batch_len;
+        pthread_mutex_unlock(&shard->mutex);
+
+        if(reap) {
+            __atomic_store_n(prev, shard->next, __ATOMIC_RELEASE);
+            pthread_cond_destroy(&shard->nonfull);
+            pthread_mutex_destroy(&shard->mutex);
+            free(shard->ring);
+            free(shard->batch);
+            free(shard);
+        } else {
+            prev = &shard->next;
+        }
+    }
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+static void merger_wakeup_init(void) {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&merger_wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* Waits until 'deadline', in monotonic_ns() time, or until
+ * vlog_stop_async().  With 'idle', also wakes up when a producer adds a
+ * record. */
+static void merger_wait(uint64_t deadline, bool idle) {
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+
+    pthread_mutex_lock(&merger_mutex);
+    if(idle) {
+        __atomic_store_n(&merger_idle, true, __ATOMIC_SEQ_CST);
+    }
+    if(is_async_running() && !(idle && shards_pending(false))) {
+        pthread_cond_timedwait(&merger_wakeup, &merger_mutex, &ts);
+    }
+    __atomic_store_n(&merger_idle, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&merger_mutex);
+}
+
+/* Logs, for each module that dropped messages since the last call, how many
+ * it dropped.  'now' is the current monotonic_ns() time, in seconds. */
+static void report_drops(uint64_t now) {
+    unsigned long long n[VLM_N_MODULES];
+    unsigned long long dropped;
+    struct vlog_record rec;
+    enum vlog_module module;
+    enum vlog_level level;
+    unsigned int interval;
+
+    interval = now - last_report;
+    last_report = now;
+    for(module = 0; module < VLM_N_MODULES; module++) {
+        n[module] = 0;
+        for(level = 0; level < VLL_N_LEVELS; level++) {
+            dropped = __atomic_load_n(&n_dropped[module][level], __ATOMIC_RELAXED);
+            n[module] += dropped - n_reported[module][level];
+            n_reported[module][level] = dropped;
+        }
+    }
+
+    for(module = 0; module < VLM_N_MODULES; module++) {
+        rec.module = module;
+        rec.level = VLL_WARN;
+        rec.facilities = get_facilities(cur_table(), module, VLL_WARN);
+        rec.file = __FILE__;
+        rec.line = __LINE__;
+        rec.when = (uint64_t)now * 1000000000;
+        rec.tsc = false;
+        if(n[module] && rec.facilities) {
+            snprintf(rec.message, sizeof(rec.message),
+            "Dropped %llu messages in last %u seconds due to full log queue",
+            n[module], interval);
+            write_record(&rec, true);
+        }
+    }
+}
+
+/* Body of the merger thread: writes the records in all the shards to the
+ * facilities in timestamp order, until asynchronous logging stops.
+ *
+ * A record is only written once it is VLOG_MERGE_WINDOW_MS old, so that a
+ * record that another thread timestamped earlier but queued later still
+ * comes first. */
+static void* merger_main(void* arg) {
+    const uint64_t window = (uint64_t)VLOG_MERGE_WINDOW_MS * 1000000;
+    struct shard* oldest;
+    struct shard* shard;
+    uint64_t others_ns;
+    uint64_t now;
+    bool stopping;
+
+    for(;;) {
+        stopping = !is_async_running();
+        now = monotonic_ns();
+
+        /* Find the shard with the oldest record, and the timestamp of the
+         * oldest record in any other shard. */
+        oldest = NULL;
+        others_ns = UINT64_MAX;
+        for(shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+            shard_refill(shard);
+            if(!shard->has_next) {
+                continue;
+            }
+            if(!oldest || shard->next_ns < oldest->next_ns) {
+                if(oldest) {
+                    others_ns = oldest->next_ns;
+                }
+                oldest = shard;
+            } else {
+                others_ns = MIN(others_ns, shard->next_ns);
+            }
+        }
+
+        if(oldest) {
+            /* Write out 'oldest''s records until another shard's is older. */
+            while(oldest->has_next && oldest->next_ns <= others_ns
+            && (stopping || oldest->next_ns + window <= now)) {
+                write_record(oldest->next_rec, false);
+                oldest->batch_off += record_size(oldest->next_rec);
+                oldest->has_next = false;
+                shard_refill(oldest);
+            }
+            if(oldest->has_next && oldest->next_ns + window > now && !stopping) {
+                flush_facilities();
+                merger_wait(oldest->next_ns + window, false);
+            }
+        } else if(stopping) {
+            if(!shards_pending(true)) {
+                break;
+            }
+        } else {
+            flush_facilities();
+            reap_shards();
+            merger_wait(now + 1000000000, true);
+        }
+
+        if(now / 1000000000 - last_report >= VLOG_DROP_REPORT_INTERVAL) {
+            report_drops(now / 1000000000);
+        }
+    }
+
+    flush_facilities();
+    report_drops(monotonic_ns() / 1000000000);
+    return NULL;
+}
+
+/* Starts asynchronous logging: from now on, each thread passes its messages
+ * through a queue of its own to a merger thread, which writes them to the
+ * facilities in timestamp order, and vlog_set_policy() decides what happens
+ * when a thread's queue is full.
+ *
+ * Each thread that logs gets a queue of 'size' bytes, in which a message
+ * takes up about 40 bytes more than its text.  'size' is rounded up to make
+ * room for at least one message of VLOG_MSG_MAX_LEN bytes.  Returns 0 if
+ * successful, otherwise a positive errno value. */
+int vlog_start_async(size_t size) {
+    const size_t align = __alignof__(struct vlog_record);
+    int error;
+
+    if(!size) {
+        return EINVAL;
+    }
+    pthread_once(&merger_once, merger_wakeup_init);
+
+    pthread_mutex_lock(&merger_mutex);
+    if(async_running) {
+        pthread_mutex_unlock(&merger_mutex);
+        return EALREADY;
+    }
+
+    async_size = MAX(size, sizeof(struct vlog_record)) / align * align;
+    last_report = monotonic_ns() / 1000000000;
+    __atomic_store_n(&async_running, true, __ATOMIC_RELEASE);
+
+    error = pthread_create(&merger_thread, NULL, merger_main, NULL);
+    if(error) {
+        __atomic_store_n(&async_running, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&merger_mutex);
+
+    return error;
+}
+
+/* Stops asynchronous logging, after writing out every queued message.  Later
+ * messages are written directly by the thread that logs them.  Also frees the
+ * queues of threads that have exited. */
+void vlog_stop_async(void) {
+    struct shard* shard;
+
+    pthread_mutex_lock(&merger_mutex);
+    if(!async_running) {
+        pthread_mutex_unlock(&merger_mutex);
+        reap_shards();
+        return;
+    }
+    __atomic_store_n(&async_running, false, __ATOMIC_RELEASE);
+    pthread_cond_signal(&merger_wakeup);
+    pthread_mutex_unlock(&merger_mutex);
+
+    /* Wake up producers waiting for room, so that they write directly. */
+    pthread_mutex_lock(&shards_mutex);
+    for(shard = shards; shard; shard = shard->next) {
+        pthread_mutex_lock(&shard->mutex);
+        pthread_cond_broadcast(&shard->nonfull);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    pthread_mutex_unlock(&shards_mutex);
+
+    pthread_join(merger_thread, NULL);
+    reap_shards();
+}
+
+/* Enables or disables timestamping messages with the CPU's time-stamp
+ * counter (TSC) instead of the system clock.  Reading the TSC is much cheaper
+ * than asking the system for the time, and the background thread keeps it
+ * calibrated against the system clock.  Returns 0 if successful, otherwise a
+ * positive errno value, e.g. ENOTSUP if this CPU lacks an invariant TSC. */
+int vlog_use_tsc(bool enable) {
+    struct timespec delay = { 0, 10000000 };
+    int error = 0;
+
+    if(!enable) {
+        __atomic_store_n(&use_tsc, false, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if(!have_invariant_tsc()) {
+        return ENOTSUP;
+    }
+
+    pthread_mutex_lock(&bg_mutex);
+    if(!use_tsc) {
+        /* Measure the TSC rate over a short interval to start with, from
+         * scratch rather than relative to a calibration from an earlier
+         * vlog_use_tsc(). */
+        tsc_sample = 0;
+        __atomic_store_n(&tsc_mult, 0, __ATOMIC_RELAXED);
+        tsc_calibrate();
+        nanosleep(&delay, NULL);
+        tsc_calibrate();
+
+        error = tsc_mult ? bg_start() : ENOTSUP;
+        if(!error) {
+            __atomic_store_n(&use_tsc, true, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&bg_mutex);
+
+    return error;
+}
+
+/* Replaces the logging level configuration by the one in 'file_name', in the
+ * syntax accepted by vlog_set_levels_from_string(), and then watches the
+ * file, reapplying it whenever it is written or replaced.  If a changed file
+ * is invalid, logs why and keeps the configuration as it was.  A null
+ * 'file_name' stops watching.
+ *
+ * Returns 0 if successful, otherwise a positive errno value, in which case
+ * the configuration and the file being watched, if any, are unchanged. */
+int vlog_set_config_file(const char* file_name) {
+    const char* slash;
+    char* dir_name;
+    int error;
+    int fd;
+
+    pthread_mutex_lock(&bg_mutex);
+    if(!file_name) {
+        config_unwatch();
+        pthread_mutex_unlock(&bg_mutex);
+        return 0;
+    }
+
+    error = load_config_file(file_name);
+    if(error) {
+        pthread_mutex_unlock(&bg_mutex);
+        return error;
+    }
+
+    /* Watch the directory rather than the file, to notice the file being
+     * replaced, as many editors do. */
+    slash = strrchr(file_name, '/');
+    dir_name = slash ? strndup(file_name, MAX(slash - file_name, 1)) : strdup(".");
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(!dir_name || fd < 0 || inotify_add_watch(fd, dir_name, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        error = !dir_name ? ENOMEM : errno;
+        VLOG_WARN(LOG_MODULE, "%s: could not watch for changes: %s",
+        file_name, strerror(error));
+        if(fd >= 0) {
+            close(fd);
+        }
+        free(dir_name);
+        pthread_mutex_unlock(&bg_mutex);
+        return error;
+    }
+    free(dir_name);
+
+    config_unwatch();
+    config_file_name = strdup(file_name);
+    if(!config_file_name) {
+        close(fd);
+        pthread_mutex_unlock(&bg_mutex);
+        return ENOMEM;
+    }
+    slash = strrchr(config_file_name, '/');
+    config_base_name = slash ? slash + 1 : config_file_name;
+    config_inotify_fd = fd;
+
+    error = bg_start();
+    bg_wake();
+    pthread_mutex_unlock(&bg_mutex);
+
+    return error;
+}
+
+/* Makes the console facility collect lines in a buffer of 'size' bytes and
+ * write them out together, instead of writing each line as it is logged.
+ * The buffer is written out when it fills up, when a message at VLL_ERR or
+ * more severe is logged, and otherwise at most 'flush_ms' milliseconds after
+ * the first line in it was logged.  A 'size' of 0 restores writing each line
+ * immediately.  Returns 0 if successful, otherwise a positive errno value. */
+int vlog_set_console_buffer(size_t size, unsigned int flush_ms) {
+    char* buf = NULL;
+    int error = 0;
+
+    if(size && !(buf = malloc(size))) {
+        return ENOMEM;
+    }
+
+    pthread_mutex_lock(&bg_mutex);
+    if(size) {
+        error = bg_start();
+    }
+    if(!error) {
+        pthread_mutex_lock(&sink_mutex);
+        console_flush();
+        free(console_buf);
+        console_buf = buf;
+        console_size = size;
+        console_len = 0;
+        console_flush_ms = flush_ms;
+        console_parked = true;
+        pthread_mutex_unlock(&sink_mutex);
+    } else {
+        free(buf);
+    }
+    pthread_mutex_unlock(&bg_mutex);
+
+    return error;
+}
+
+/* Enables or disables coloring level names on the console.  Colors are only
+ * used if the console is a terminal. */
+void vlog_set_console_color(bool enable) {
+    pthread_mutex_lock(&sink_mutex);
+    console_color = enable && isatty(STDERR_FILENO);
+    pthread_mutex_unlock(&sink_mutex);
+}
+
+/* Conditional logging scopes.
+ *
+ * Each thread captures the disabled messages of its scope in an arena of its
+ * own.  A message is captured as a 'struct scope_record' followed by its
+ * printf() arguments, each in a 'union scope_arg' or, for strings, as a length
+ * in a 'union scope_arg' followed by a copy of the string.  Formatting is put
+ * off until the message is flushed, which usually it is not.  Formats with
+ * conversions that cannot be replayed later, such as "%m" or "%n", are
+ * formatted when captured instead, and recorded with a null 'format'. */
+struct scope_record {
+    size_t size; /* Bytes including the arguments and padding. */
+    enum vlog_module module;
+    enum vlog_level level;
+    const char* file;
+    int line;
+    bool tsc;
+    uint64_t when;
+    const char* format; /* Null if the formatted message follows. */
+};
+
+union scope_arg {
+    int i;
+    long l;
+    long long ll;
+    intmax_t j;
+    size_t z;
+    ptrdiff_t t;
+    double d;
+    long double ld;
+    const void* p;
+};
+
+#define SCOPE_ALIGN(N) (((N) + __alignof__(union scope_arg) - 1) & ~(__alignof__(union scope_arg) - 1))
+
+/* The type of the argument consumed by a printf() conversion. */
+enum scope_arg_type {
+    SA_NONE, /* "%%". */
+    SA_INT,
+    SA_LONG,
+    SA_LLONG,
+    SA_INTMAX,
+    SA_SIZE,
+    SA_PTRDIFF,
+    SA_DOUBLE,
+    SA_LDOUBLE,
+    SA_PTR,
+    SA_STR
+};
+
+/* A printf() conversion specification, split into its parts. */
+struct scope_conv {
+    const char* flags;
+    int flags_len;
+    const char* width; /* Digits or "*". */
+    int width_len;
+    const char* prec;  /* Digits or "*" after the '.', or null. */
+    int prec_len;
+    const char* rest;  /* Length modifier and conversion character. */
+    int rest_len;
+    enum scope_arg_type type;
+};
+
+static __thread struct {
+    char* arena;             /* VLOG_SCOPE_ARENA_SIZE bytes, or null. */
+    size_t used;             /* Bytes of 'arena' in use. */
+    unsigned int n_dropped;  /* Messages that did not fit in 'arena'. */
+    bool keep;               /* Flush at the end of the outermost scope. */
+} scope;
+
+__thread unsigned int vlog_scope_depth;
+
+static pthread_once_t scope_once = PTHREAD_ONCE_INIT;
+static pthread_key_t scope_key;
+
+static void scope_key_create(void) {
+    pthread_key_create(&scope_key, free);
+}
+
+/* Parses the conversion specification that follows the '%' at 'p' into
+ * 'conv'.  Returns a pointer just past the specification, or a null pointer if
+ * it is one that cannot be replayed from a captured argument. */
+static const char* scope_parse_conv(const char* p, struct scope_conv* conv) {
+    char mod = 0;
+
+    conv->flags = ++p;
+    while(*p && strchr("-+ #0'I", *p)) {
+        p++;
+    }
+    conv->flags_len = p - conv->flags;
+
+    conv->width = p;
+    if(*p == '*') {
+        p++;
+    } else {
+        while(isdigit((unsigned char)*p)) {
+            p++;
+        }
+    }
+    conv->width_len = p - conv->width;
+
+    conv->prec = NULL;
+    conv->prec_len = 0;
+    if(*p == '.') {
+        conv->prec = ++p;
+        if(*p == '*') {
+            p++;
+        } else {
+            while(isdigit((unsigned char)*p)) {
+                p++;
+            }
+        }
+        conv->prec_len = p - conv->prec;
+    }
+
+    conv->rest = p;
+    if(*p == 'h') {
+        p += p[1] == 'h' ? 2 : 1;
+    } else if(*p == 'l') {
+        mod = p[1] == 'l' ? 'q' : 'l';
+        p += mod == 'q' ? 2 : 1;
+    } else if(*p && strchr("qLjzZt", *p)) {
+        mod = *p == 'L' ? 'q' : *p == 'Z' ? 'z' : *p;
+        p++;
+    }
+
+    switch(*p++) {
+    case '%':
+        conv->type = SA_NONE;
+        break;
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        conv->type = mod == 'l' ? SA_LONG
+                     : mod == 'q' ? SA_LLONG
+                     : mod == 'j' ? SA_INTMAX
+                     : mod == 'z' ? SA_SIZE
+                     : mod == 't' ? SA_PTRDIFF
+                                  : SA_INT;
+        break;
+    case 'c':
+        if(mod) {
+            return NULL;
+        }
+        conv->type = SA_INT;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        conv->type = mod == 'q' ? SA_LDOUBLE : SA_DOUBLE;
+        break;
+    case 's':
+        if(mod) {
+            return NULL;
+        }
+        conv->type = SA_STR;
+        break;
+    case 'p':
+        conv->type = SA_PTR;
+        break;
+    default:
+        /* "%n", "%m", wide characters, positional arguments, and nonsense. */
+        return NULL;
+    }
+    conv->rest_len = p - conv->rest;
+    return p;
+}
+
+/* Appends 'size' bytes from 'data' to the arena at offset '*ofs', padded to
+ * the alignment of 'union scope_arg'.  Returns false if they do not fit. */
+static bool scope_put(size_t* ofs, const void* data, size_t size) {
+    if(VLOG_SCOPE_ARENA_SIZE - *ofs < size) {
+        return false;
+    }
+    memcpy(scope.arena + *ofs, data, size);
+    *ofs = SCOPE_ALIGN(*ofs + size);
+    return *ofs <= VLOG_SCOPE_ARENA_SIZE;
+}
+
+static bool scope_put_arg(size_t* ofs, const union scope_arg* arg) {
+    return scope_put(ofs, arg, sizeof *arg);
+}
+
+/* Captures the arguments of 'format' from 'args' into the arena at '*ofs'.
+ * Returns false if they do not fit. */
+static bool scope_capture_args(size_t* ofs, const char* format, va_list args) {
+    struct scope_conv conv;
+    const char* p;
+
+    for(p = strchr(format, '%'); p; p = strchr(p, '%')) {
+        union scope_arg arg;
+        int prec = -1;
+
+        p = scope_parse_conv(p, &conv);
+        if(conv.width_len && *conv.width == '*') {
+            arg.i = va_arg(args, int);
+            if(!scope_put_arg(ofs, &arg)) {
+                return false;
+            }
+        }
+        if(conv.prec) {
+            prec = *conv.prec == '*' ? va_arg(args, int) : atoi(conv.prec);
+            if(*conv.prec == '*') {
+                arg.i = prec;
+                if(!scope_put_arg(ofs, &arg)) {
+                    return false;
+                }
+            }
+        }
+
+        switch(conv.type) {
+        case SA_NONE:
+            continue;
+        case SA_INT:
+            arg.i = va_arg(args, int);
+            break;
+        case SA_LONG:
+            arg.l = va_arg(args, long);
+            break;
+        case SA_LLONG:
+            arg.ll = va_arg(args, long long);
+            break;
+        case SA_INTMAX:
+            arg.j = va_arg(args, intmax_t);
+            break;
+        case SA_SIZE:
+            arg.z = va_arg(args, size_t);
+            break;
+        case SA_PTRDIFF:
+            arg.t = va_arg(args, ptrdiff_t);
+            break;
+        case SA_DOUBLE:
+            arg.d = va_arg(args, double);
+            break;
+        case SA_LDOUBLE:
+            arg.ld = va_arg(args, long double);
+            break;
+        case SA_PTR:
+            arg.p = va_arg(args, void*);
+            break;
+        case SA_STR: {
+            const char* s = va_arg(args, const char*);
+            size_t max = prec >= 0 && prec < VLOG_MSG_MAX_LEN ? prec : VLOG_MSG_MAX_LEN - 1;
+
+            if(!s) {
+                s = "(null)";
+            }
+            arg.z = strnlen(s, max);
+            if(!scope_put_arg(ofs, &arg) || VLOG_SCOPE_ARENA_SIZE - *ofs <= arg.z) {
+                return false;
+            }
+            memcpy(scope.arena + *ofs, s, arg.z);
+            scope.arena[*ofs + arg.z] = '\0';
+            *ofs = SCOPE_ALIGN(*ofs + arg.z + 1);
+            if(*ofs > VLOG_SCOPE_ARENA_SIZE) {
+                return false;
+            }
+            continue;
+        }
+        }
+        if(!scope_put_arg(ofs, &arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Captures a message into the calling thread's arena, or counts it as
+ * dropped if it does not fit. */
+static void scope_capture(enum vlog_module module,
+enum vlog_level level,
+const char* file,
+int line,
+uint64_t when,
+bool tsc,
+const char* format,
+va_list args) {
+    struct scope_record rec;
+    struct scope_conv conv;
+    size_t ofs;
+    bool ok;
+
+    if(!scope.arena) {
+        scope.arena = malloc(VLOG_SCOPE_ARENA_SIZE);
+        if(!scope.arena) {
+            scope.n_dropped++;
+            return;
+        }
+        pthread_once(&scope_once, scope_key_create);
+        pthread_setspecific(scope_key, scope.arena);
+    }
+
+    rec.module = module;
+    rec.level = level;
+    rec.file = file;
+    rec.line = line;
+    rec.tsc = tsc;
+    rec.when = when;
+    rec.format = format;
+    for(const char* p = strchr(format, '%'); p; p = strchr(p, '%')) {
+        p = scope_parse_conv(p, &conv);
+        if(!p) {
+            rec.format = NULL;
+            break;
+        }
+    }
+
+    ofs = SCOPE_ALIGN(scope.used + sizeof rec);
+    if(ofs > VLOG_SCOPE_ARENA_SIZE) {
+        ok = false;
+    } else if(rec.format) {
+        ok = scope_capture_args(&ofs, format, args);
+    } else {
+        size_t room = VLOG_SCOPE_ARENA_SIZE - ofs;
+        int n = vsnprintf(scope.arena + ofs, room, format, args);
+
+        ok = n >= 0 && (size_t)n < room;
+        ofs = SCOPE_ALIGN(ofs + n + 1);
+    }
+
+    if(ok && ofs <= VLOG_SCOPE_ARENA_SIZE) {
+        rec.size = ofs - scope.used;
+        memcpy(scope.arena + scope.used, &rec, sizeof rec);
+        scope.used = ofs;
+    } else {
+        scope.n_dropped++;
+    }
+}
+
+/* Formats the message captured as 'rec' into 'buf', which has room for 'size'
+ * bytes, and returns the length of the result. */
+static size_t scope_replay(const struct scope_record* rec, char* buf, size_t size) {
+    const char* args = (const char*)rec + SCOPE_ALIGN(sizeof *rec);
+    const char* p = rec->format;
+    size_t len = 0;
+
+    if(!p) {
+        return snprintf(buf, size, "%s", args);
+    }
+
+    while(*p && len < size - 1) {
+        const char* q = strchr(p, '%');
+        struct scope_conv conv;
+        union scope_arg arg;
+        char width[16], prec[16], spec[64];
+        int n = 0;
+
+        if(!q) {
+            q = p + strlen(p);
+        }
+        n = MIN((size_t)(q - p), size - 1 - len);
+        memcpy(buf + len, p, n);
+        len += n;
+        if(!*q) {
+            break;
+        }
+
+        p = scope_parse_conv(q, &conv);
+        snprintf(width, sizeof width, "%.*s", MIN(conv.width_len, 8), conv.width);
+        if(conv.width_len && *conv.width == '*') {
+            memcpy(&arg, args, sizeof arg);
+            args += sizeof arg;
+            snprintf(width, sizeof width, "%d", arg.i);
+        }
+        snprintf(prec, sizeof prec, conv.prec ? ".%.*s" : "", MIN(conv.prec_len, 8), conv.prec);
+        if(conv.prec && *conv.prec == '*') {
+            memcpy(&arg, args, sizeof arg);
+            args += sizeof arg;
+            snprintf(prec, sizeof prec, arg.i >= 0 ? ".%d" : "", arg.i);
+        }
+        snprintf(spec, sizeof spec, "%%%.*s%s%s%.*s", MIN(conv.flags_len, 8), conv.flags, width, prec,
+        conv.rest_len, conv.rest);
+
+        if(conv.type != SA_NONE) {
+            memcpy(&arg, args, sizeof arg);
+            args += sizeof arg;
+        }
+        switch(conv.type) {
+        case SA_NONE:
+            n = snprintf(buf + len, size - len, "%%");
+            break;
+        case SA_INT:
+            n = snprintf(buf + len, size - len, spec, arg.i);
+            break;
+        case SA_LONG:
+            n = snprintf(buf + len, size - len, spec, arg.l);
+            break;
+        case SA_LLONG:
+            n = snprintf(buf + len, size - len, spec, arg.ll);
+            break;
+        case SA_INTMAX:
+            n = snprintf(buf + len, size - len, spec, arg.j);
+            break;
+        case SA_SIZE:
+            n = snprintf(buf + len, size - len, spec, arg.z);
+            break;
+        case SA_PTRDIFF:
+            n = snprintf(buf + len, size - len, spec, arg.t);
+            break;
+        case SA_DOUBLE:
+            n = snprintf(buf + len, size - len, spec, arg.d);
+            break;
+        case SA_LDOUBLE:
+            n = snprintf(buf + len, size - len, spec, arg.ld);
+            break;
+        case SA_PTR:
+            n = snprintf(buf + len, size - len, spec, arg.p);
+            break;
+        case SA_STR:
+            n = snprintf(buf + len, size - len, spec, args);
+            args += SCOPE_ALIGN(arg.z + 1);
+            break;
+        }
+        if(n > 0) {
+            len = MIN(len + n, size - 1);
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* Writes the messages captured in the calling thread's arena, in order, to
+ * the facilities that log errors for their modules, and empties the arena. */
+static void scope_flush(void) {
+    int save_errno = errno;
+    struct vlog_record rec;
+    size_t ofs;
+
+    for(ofs = 0; ofs < scope.used; ofs += ((struct scope_record*)(scope.arena + ofs))->size) {
+        const struct scope_record* captured = (struct scope_record*)(scope.arena + ofs);
+
+        rec.facilities = get_facilities(cur_table(), captured->module, VLL_ERR);
+        if(!rec.facilities) {
+            continue;
+        }
+        rec.module = captured->module;
+        rec.level = captured->level;
+        rec.file = captured->file;
+        rec.line = captured->line;
+        rec.when = captured->when;
+        rec.tsc = captured->tsc;
+        scope_replay(captured, rec.message, sizeof rec.message);
+        if(!queue_record(&rec)) {
+            write_record(&rec, true);
+        }
+    }
+    scope.used = 0;
+
+    if(scope.n_dropped) {
+        rec.module = VLM_vlog;
+        rec.level = VLL_WARN;
+        rec.facilities = get_facilities(cur_table(), VLM_vlog, VLL_ERR);
+        rec.file = __FILE__;
+        rec.line = __LINE__;
+        rec.tsc = __atomic_load_n(&use_tsc, __ATOMIC_RELAXED);
+        rec.when = read_clock(rec.tsc);
+        snprintf(rec.message, sizeof rec.message,
+        "Dropped %u messages from log scope because it was full", scope.n_dropped);
+        if(rec.facilities && !queue_record(&rec)) {
+            write_record(&rec, true);
+        }
+        scope.n_dropped = 0;
+    }
+    errno = save_errno;
+}
+
+/* Opens a conditional logging scope on the calling thread.  See vlog.h. */
+void vlog_scope_begin(void) {
+    if(!vlog_scope_depth++) {
+        scope.used = 0;
+        scope.n_dropped = 0;
+        scope.keep = false;
+    }
+}
+
+/* Closes the calling thread's innermost conditional logging scope.  If it is
+ * the outermost, writes out its captured messages if 'keep' is true or if
+ * any scope inside it was kept or logged an error, and discards them
+ * otherwise. */
+void vlog_scope_end(bool keep) {
+    assert(vlog_scope_depth > 0);
+    scope.keep |= keep;
+    if(!--vlog_scope_depth) {
+        if(scope.keep) {
+            scope_flush();
+        }
+        scope.used = 0;
+        scope.n_dropped = 0;
+    }
+}
+
+/* Writes 'message' to the log at the given 'level' and as coming from the
+ * given 'module', according to the configuration in 'table'.
+ *
+ * Guaranteed to preserve errno. */
+static void log_valist(const struct level_table* table,
+enum vlog_module module,
+enum vlog_level level,
+const char* file,
+int line,
+uint64_t when,
+bool tsc,
+const char* message,
+va_list args) {
+    unsigned int facilities = get_facilities(table, module, level);
+
+    if(facilities) {
+        int save_errno = errno;
+        struct vlog_record rec;
+
+        rec.module = module;
+        rec.level = level;
+        rec.facilities = facilities;
+        rec.file = file;
+        rec.line = line;
+        rec.when = when;
+        rec.tsc = tsc;
+        vsnprintf(rec.message, sizeof(rec.message), message, args);
+
+        if(!queue_record(&rec)) {
+            write_record(&rec, true);
+        }
+
+        errno = save_errno;
+    }
+}
+
+/* Writes 'message' to the log at the given 'level' and as coming from the
+ * given 'module'.
+ *
+ * Guaranteed to preserve errno. */
+void vlog_valist(enum vlog_module module,
+enum vlog_level level,
+const char* file,
+int line,
+uint64_t when,
+bool tsc,
+const char* message,
+va_list args) {
+    log_valist(cur_table(), module, level, file, line, when, tsc, message, args);
+}
+
+void vlog(enum vlog_module module, enum vlog_level level, const char* file, int line, const char* message, ...) {
+    const struct level_table* table = cur_table();
+    bool tsc = __atomic_load_n(&use_tsc, __ATOMIC_RELAXED);
+    uint64_t when = read_clock(tsc);
+    va_list args;
+
+    va_start(args, message);
+    if(vlog_scope_depth) {
+        if(level >= VLL_INFO && level > table->min_levels[module]) {
+            scope_capture(module, level, file, line, when, tsc, message, args);
+            va_end(args);
+            return;
+        }
+        if(level <= VLL_ERR) {
+            scope.keep = true;
+            scope_flush();
+        }
+    }
+    log_valist(table, module, level, file, line, when, tsc, message, args);
+    va_end(args);
+}
+
+void vlog_rate_limit(enum vlog_module module,
+enum vlog_level level,
+const char* file,
+int line,
+struct vlog_rate_limit* rl,
+const char* message,
+...) {
+    va_list args;
+
+    if(!vlog_is_enabled(module, level)) {
+        return;
+    }
+
+    bool tsc = __atomic_load_n(&use_tsc, __ATOMIC_RELAXED);
+    uint64_t when = read_clock(tsc);
+    uint64_t now = clock_to_ns(when, tsc);
+
+    if(rl->tokens < VLOG_MSG_TOKENS) {
+        if(rl->last_fill > now) {
+            /* Last filled in the future?  Time must have gone backward, or
+             * 'rl' has not been used before. */
+            rl->tokens = rl->burst;
+        } else if(rl->last_fill < now) {
+            /* Only count whole tokens as added, so that the fractions
+             * accumulate across calls. */
+            uint64_t elapsed = now - rl->last_fill;
+            unsigned int add = sat_add(sat_mul(rl->rate, MIN(elapsed / 1000000000, UINT_MAX)),
+            (elapsed % 1000000000) * rl->rate / 1000000000);
+            unsigned int tokens = sat_add(rl->tokens, add);
+            if(add) {
+                rl->tokens = MIN(tokens, rl->burst);
+                rl->last_fill = now;
+            }
         }
         if(rl->tokens < VLOG_MSG_TOKENS) {
             if(!rl->n_dropped) {
@@ -348,13 +2497,13 @@ const char* message,
     rl->tokens -= VLOG_MSG_TOKENS;
 
     va_start(args, message);
-    vlog_valist(module, level, file, line, now, message, args);
+    vlog_valist(module, level, file, line, when, tsc, message, args);
     va_end(args);
 
     if(rl->n_dropped) {
         vlog(module, level, file, line,
         "Dropped %u messages in last %u seconds due to excessive rate",
-        rl->n_dropped, (unsigned int)(now - rl->first_dropped));
+        rl->n_dropped, (unsigned int)((now - rl->first_dropped) / 1000000000));
         rl->n_dropped = 0;
     }
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #ifndef MIN
@@ -59,6 +61,22 @@ enum vlog_module {
 const char* vlog_get_module_name(enum vlog_module);
 enum vlog_module vlog_get_module_val(const char* name);
 
+/* What to do with a message when the asynchronous log queue is full. */
+#define VLOG_POLICIES            \
+    VLOG_POLICY(BLOCK)           \
+    VLOG_POLICY(DROP_NEWEST)     \
+    VLOG_POLICY(DROP_OLDEST)     \
+    VLOG_POLICY(DROP_BELOW)
+enum vlog_policy {
+#define VLOG_POLICY(NAME) VLP_##NAME,
+    VLOG_POLICIES
+#undef VLOG_POLICY
+    VLP_N_POLICIES
+};
+
+const char* vlog_get_policy_name(enum vlog_policy);
+enum vlog_policy vlog_get_policy_val(const char* name);
+
 /* Rate-limiter for log messages. */
 struct vlog_rate_limit {
     /* Configuration settings. */
@@ -67,8 +85,8 @@ struct vlog_rate_limit {
 
     /* Current status. */
     unsigned int tokens;    /* Current number of tokens. */
-    time_t last_fill;       /* Last time tokens added. */
-    time_t first_dropped;   /* Time first message was dropped. */
+    uint64_t last_fill;     /* Last time tokens added, in ns. */
+    uint64_t first_dropped; /* Time first message was dropped, in ns. */
     unsigned int n_dropped; /* Number of messages dropped. */
 };
 
@@ -92,11 +110,54 @@ struct vlog_rate_limit {
 /* Configuring how each module logs messages. */
 enum vlog_level vlog_get_level(enum vlog_module, enum vlog_facility);
 void vlog_set_levels(enum vlog_module, enum vlog_facility, enum vlog_level);
+int vlog_set_levels_from_string(const char*);
+int vlog_set_config_file(const char* file_name);
 bool vlog_is_enabled(enum vlog_module, enum vlog_level);
 
+/* Configuring what happens to each module's messages when asynchronous
+ * logging falls behind. */
+enum vlog_policy vlog_get_policy(enum vlog_module);
+void vlog_set_policy(enum vlog_module, enum vlog_policy, enum vlog_level threshold);
+unsigned long long vlog_get_dropped(enum vlog_module, enum vlog_level);
+
+/* Interval, in seconds, between summaries of messages dropped because the
+ * asynchronous log queue was full. */
+#define VLOG_DROP_REPORT_INTERVAL 5
+
+/* Age, in milliseconds, that an asynchronously logged message must reach
+ * before it is written, so that messages from different threads come out in
+ * timestamp order despite the threads being scheduled unevenly. */
+#define VLOG_MERGE_WINDOW_MS 10
+
+/* Configuring timestamps. */
+int vlog_use_tsc(bool enable);
+
+/* Interval, in seconds, between recalibrations of the TSC against the system
+ * clock while vlog_use_tsc() is enabled. */
+#define VLOG_TSC_CALIBRATE_INTERVAL 10
+
 /* Configuring log facilities. */
 const char* vlog_get_log_file(void);
 int vlog_set_log_file(const char* file_name, int max_size);
+int vlog_set_console_buffer(size_t size, unsigned int flush_ms);
+void vlog_set_console_color(bool enable);
+
+/* Conditional logging.  Between vlog_scope_begin() and vlog_scope_end(), the
+ * calling thread's INFO and DBG messages that are disabled for their module
+ * are captured instead of being discarded.  The captured messages are written,
+ * in order, to the facilities that log errors if an ERR or EMER message is
+ * logged in the scope or if vlog_scope_end() is passed true, and otherwise
+ * discarded without ever being formatted.  Scopes nest; only the outermost
+ * vlog_scope_end() flushes or discards.
+ *
+ * A message's format string must remain valid until its scope ends, as string
+ * literals do. */
+void vlog_scope_begin(void);
+void vlog_scope_end(bool keep);
+
+/* Bytes of memory in which each thread captures the messages of its scope.
+ * Messages that do not fit are counted and then dropped. */
+#define VLOG_SCOPE_ARENA_SIZE 65536
 
 /* Maximum length of a single log message, including the terminating null
  * character.  Longer messages will be truncated. */
@@ -105,6 +166,8 @@ int vlog_set_log_file(const char* file_name, int max_size);
 /* Function for actual logging. */
 void vlog_init(void);
 void vlog_exit(void);
+int vlog_start_async(size_t size);
+void vlog_stop_async(void);
 void vlog(enum vlog_module, enum vlog_level, const char* file, int line, const char* format, ...)
 __attribute__((format(printf, 5, 6)));
 void vlog_rate_limit(enum vlog_module,
@@ -131,12 +194,13 @@ const char*,
 
 /* More convenience macros, for testing whether a given level is enabled in
  * MODULE.  When constructing a log message is expensive, this enables it
- * to be skipped. */
+ * to be skipped.  Within a conditional logging scope, INFO and DBG are always
+ * enabled, because their messages are captured. */
 #define VLOG_IS_EMER_ENABLED(MODULE) true
 #define VLOG_IS_ERR_ENABLED(MODULE) vlog_is_enabled(MODULE, VLL_EMER)
 #define VLOG_IS_WARN_ENABLED(MODULE) vlog_is_enabled(MODULE, VLL_WARN)
-#define VLOG_IS_INFO_ENABLED(MODULE) vlog_is_enabled(MODULE, VLL_INFO)
-#define VLOG_IS_DBG_ENABLED(MODULE) vlog_is_enabled(MODULE, VLL_DBG)
+#define VLOG_IS_INFO_ENABLED(MODULE) (vlog_is_enabled(MODULE, VLL_INFO) || vlog_scope_depth)
+#define VLOG_IS_DBG_ENABLED(MODULE) (vlog_is_enabled(MODULE, VLL_DBG) || vlog_scope_depth)
 
 /* Convenience macros.
  * Guaranteed to preserve errno.
@@ -151,11 +215,12 @@ const char*,
     VLOG_RL(MODULE, RL, VLL_DBG, __FILE__, __LINE__, __VA_ARGS__)
 
 /* Implementation details. */
-#define VLOG(MODULE, LEVEL, _FILE, LINE, ...)              \
-    do {                                                   \
-        if(min_vlog_levels[MODULE] >= LEVEL) {             \
-            vlog(MODULE, LEVEL, _FILE, LINE, __VA_ARGS__); \
-        }                                                  \
+#define VLOG(MODULE, LEVEL, _FILE, LINE, ...)                      \
+    do {                                                           \
+        if(min_vlog_levels[MODULE] >= LEVEL                        \
+        || (vlog_scope_depth && LEVEL >= VLL_INFO)) {              \
+            vlog(MODULE, LEVEL, _FILE, LINE, __VA_ARGS__);         \
+        }                                                          \
     } while(0)
 #define VLOG_RL(MODULE, RL, LEVEL, _FILE, LINE, ...)                      \
     do {                                                                  \
@@ -163,6 +228,7 @@ const char*,
             vlog_rate_limit(MODULE, LEVEL, _FILE, LINE, RL, __VA_ARGS__); \
         }                                                                 \
     } while(0)
-extern enum vlog_level min_vlog_levels[VLM_N_MODULES];
+extern enum vlog_level* min_vlog_levels;
+extern __thread unsigned int vlog_scope_depth;
 
 #endif
\ No newline at end of file